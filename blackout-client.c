@@ -0,0 +1,305 @@
+/* -*- C -*- */
+/* Copyright 2024 Nikita Danilov <danilov@gmail.com> */
+/* See https://github.com/nikitadanilov/escrow/blob/master/LICENCE for the licencing information. */
+
+/*
+ * A load generator measuring the blackout of a service restarted via the
+ * escrow. It starts the server (blackout-server.c by default), opens many
+ * connections to it and keeps a ping-pong running on each of them. Every
+ * interval it restarts the server: SIGTERM, wait for the exit, start a new
+ * instance. Per connection and per restart it records the stall, the longest
+ * time without an echo, and reports the percentiles at the end. A stall still
+ * in progress when the client stops waiting (SETTLE) is counted up to then and
+ * reported as censored. At the end the last server instance is stopped with
+ * SIGINT, which blackout-server takes as "exit without a checkpoint and stop
+ * escrowd", so that no escrowd is left behind holding the connections (and the
+ * output pipe).
+ *
+ *     blackout-client [-n conns] [-c cycles] [-i interval-ms] [-p port] [server command...]
+ *
+ * Linux only (epoll).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <signal.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <err.h>
+#include <errno.h>
+
+enum {
+        PORT     = 8087,
+        BATCH    = 256,
+        SETTLE   = 10, /* Seconds to wait for all connections to recover. */
+        MAX_RTT  = 1 << 20
+};
+
+struct conn {
+        int      fd;
+        uint64_t seq;    /* The ping in flight. */
+        uint64_t buf;
+        int32_t  got;
+        double   sent;
+        double   last;   /* The last echo. */
+        double   echoed; /* When the ping echoed last was sent. */
+        double   gap;    /* The longest stall in this cycle. */
+        bool     lost;
+};
+
+static struct conn *conns;
+static int32_t      nr_conns = 1000;
+static int32_t      nr_lost;
+static int32_t      nr_censored; /* Stalls still in progress when SETTLE ran out. */
+static double      *rtt;  /* Round trips outside of the restarts. */
+static int32_t      nr_rtt;
+static bool         steady = true;
+
+static double now(void) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static pid_t spawn(char **argv) {
+        pid_t pid = fork();
+        if (pid == 0) {
+                execvp(argv[0], argv);
+                err(EXIT_FAILURE, "execvp(%s)", argv[0]);
+        } else if (pid < 0) {
+                err(EXIT_FAILURE, "fork()");
+        }
+        return pid;
+}
+
+static int dial(int port) {
+        struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port) };
+        inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+        for (int i = 0; i < 1000; ++i) { /* The first server instance might be starting. */
+                int sock = socket(AF_INET, SOCK_STREAM, 0);
+                if (sock < 0) {
+                        err(EXIT_FAILURE, "socket()");
+                }
+                if (connect(sock, (struct sockaddr *)&addr, sizeof addr) == 0) {
+                        return sock;
+                } else if (errno != ECONNREFUSED) {
+                        err(EXIT_FAILURE, "connect()");
+                }
+                close(sock);
+                usleep(10000);
+        }
+        errx(EXIT_FAILURE, "Cannot connect to the server.");
+}
+
+static void ping(struct conn *c) {
+        c->buf  = ++c->seq;
+        c->got  = 0;
+        c->sent = now();
+        if (write(c->fd, &c->buf, sizeof c->buf) != sizeof c->buf) {
+                c->lost = true;
+        }
+}
+
+static void pong(struct conn *c) {
+        ssize_t nob = read(c->fd, (char *)&c->buf + c->got, sizeof c->buf - c->got);
+        double  t;
+        if (nob <= 0) {
+                c->lost = true;
+                return;
+        }
+        c->got += nob;
+        if (c->got < (int32_t)sizeof c->buf) {
+                return;
+        }
+        if (c->buf != c->seq) {
+                errx(EXIT_FAILURE, "Mismatch: %llu != %llu.",
+                     (unsigned long long)c->buf, (unsigned long long)c->seq);
+        }
+        t = now();
+        if (steady && nr_rtt < MAX_RTT) {
+                rtt[nr_rtt++] = t - c->sent;
+        }
+        if (t - c->last > c->gap) {
+                c->gap = t - c->last;
+        }
+        c->last   = t;
+        c->echoed = c->sent;
+        ping(c);
+}
+
+/*
+ * Runs the ping-pongs until DEADLINE, or until all connections had an echo of a
+ * ping sent after SINCE. An echo received after SINCE might have been sent by the
+ * old instance.
+ */
+static void pump(int ep, double deadline, double since) {
+        struct epoll_event ev[BATCH];
+        while (now() < deadline) {
+                int     n = epoll_wait(ep, ev, BATCH, 10);
+                int32_t behind = 0;
+                if (n < 0 && errno != EINTR) {
+                        err(EXIT_FAILURE, "epoll_wait()");
+                }
+                for (int i = 0; i < n; ++i) {
+                        struct conn *c = &conns[ev[i].data.u64];
+                        pong(c);
+                        if (c->lost) {
+                                epoll_ctl(ep, EPOLL_CTL_DEL, c->fd, NULL);
+                                close(c->fd);
+                                ++nr_lost;
+                        }
+                }
+                for (int32_t i = 0; since > 0 && i < nr_conns; ++i) {
+                        behind += !conns[i].lost && conns[i].echoed < since;
+                }
+                if (since > 0 && behind == 0) {
+                        break;
+                }
+        }
+}
+
+static int dcmp(const void *a, const void *b) {
+        double x = *(const double *)a;
+        double y = *(const double *)b;
+        return (x > y) - (x < y);
+}
+
+static void report(const char *label, double *v, int32_t nr) {
+        static const double pct[] = { 50, 90, 99, 99.9 };
+        if (nr == 0) {
+                return;
+        }
+        qsort(v, nr, sizeof v[0], &dcmp);
+        printf("%-8s %8i samples:", label, nr);
+        for (size_t i = 0; i < sizeof pct / sizeof pct[0]; ++i) {
+                printf("  p%g %9.3f", pct[i], v[(int32_t)(pct[i] / 100 * (nr - 1))] * 1e3);
+        }
+        printf("  max %9.3f ms\n", v[nr - 1] * 1e3);
+}
+
+int main(int argc, char **argv) {
+        static char  *server[] = { "./blackout-server", "/tmp/blackout-escrow", NULL };
+        char        **cmd      = server;
+        int32_t       cycles   = 10;
+        int32_t       interval = 1000;
+        int           port     = PORT;
+        int           ep       = epoll_create1(0);
+        int           opt;
+        double       *stall;
+        int32_t       nr_stall = 0;
+        struct rlimit rl;
+        pid_t         pid;
+        while ((opt = getopt(argc, argv, "n:c:i:p:h")) != -1) {
+                switch (opt) {
+                case 'n':
+                        nr_conns = atoi(optarg);
+                        break;
+                case 'c':
+                        cycles = atoi(optarg);
+                        break;
+                case 'i':
+                        interval = atoi(optarg);
+                        break;
+                case 'p':
+                        port = atoi(optarg);
+                        break;
+                default:
+                        errx(EXIT_FAILURE, "Usage: blackout-client [-n conns] [-c cycles] "
+                             "[-i interval-ms] [-p port] [server command...]");
+                }
+        }
+        if (optind < argc) {
+                cmd = &argv[optind];
+        }
+        if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+                rl.rlim_cur = rl.rlim_max;
+                setrlimit(RLIMIT_NOFILE, &rl);
+        }
+        conns = calloc(nr_conns, sizeof conns[0]);
+        stall = calloc((size_t)nr_conns * cycles + 1, sizeof stall[0]);
+        rtt   = calloc(MAX_RTT, sizeof rtt[0]);
+        if (ep < 0 || conns == NULL || stall == NULL || rtt == NULL) {
+                err(EXIT_FAILURE, "Initialisation");
+        }
+        signal(SIGPIPE, SIG_IGN);
+        pid = spawn(cmd);
+        for (int32_t i = 0; i < nr_conns; ++i) {
+                struct epoll_event ev = { .events = EPOLLIN, .data.u64 = i };
+                conns[i].fd   = dial(port);
+                conns[i].last = now();
+                if (epoll_ctl(ep, EPOLL_CTL_ADD, conns[i].fd, &ev) != 0) {
+                        err(EXIT_FAILURE, "epoll_ctl()");
+                }
+                ping(&conns[i]);
+        }
+        printf("%i connections, %i restarts every %i ms, server pid %i.\n",
+               nr_conns, cycles, interval, pid);
+        for (int32_t cycle = 0; cycle < cycles; ++cycle) {
+                double  kill_time;
+                double  since;
+                double  back;
+                int32_t censored = 0;
+                steady = true;
+                pump(ep, now() + interval * 1e-3, 0);
+                steady = false;
+                for (int32_t i = 0; i < nr_conns; ++i) {
+                        conns[i].gap = 0;
+                }
+                kill_time = now();
+                kill(pid, SIGTERM);
+                if (waitpid(pid, NULL, 0) != pid) {
+                        err(EXIT_FAILURE, "waitpid()");
+                }
+                pid   = spawn(cmd);
+                since = now();
+                pump(ep, since + SETTLE, since);
+                back = now();
+                for (int32_t i = 0; i < nr_conns; ++i) {
+                        /* The stall still in progress, if any. */
+                        double open = back - conns[i].last;
+                        if (conns[i].lost) {
+                                continue;
+                        }
+                        if (conns[i].echoed < since) { /* Not served by the new instance. */
+                                ++censored;
+                        }
+                        stall[nr_stall++] = open > conns[i].gap ? open : conns[i].gap;
+                }
+                nr_censored += censored;
+                if (censored == 0) {
+                        printf("restart %3i: all connections served again after "
+                               "%8.3f ms, %i lost.\n", cycle, (back - kill_time) * 1e3, nr_lost);
+                } else {
+                        printf("restart %3i: %i connections not served again within "
+                               "%i s, %i lost.\n", cycle, censored, SETTLE, nr_lost);
+                }
+        }
+        kill(pid, SIGINT); /* No checkpoint, stop escrowd. */
+        waitpid(pid, NULL, 0);
+        report("rtt", rtt, nr_rtt);
+        report("stall", stall, nr_stall);
+        printf("lost     %8i connections.\n", nr_lost);
+        printf("censored %8i stalls not over within %i s, counted as lasting that long.\n",
+               nr_censored, SETTLE);
+        return nr_lost == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/*
+ *  Local variables:
+ *  c-indentation-style: "K&R"
+ *  c-basic-offset: 8
+ *  tab-width: 8
+ *  scroll-step: 1
+ *  indent-tabs-mode: nil
+ *  End:
+ */
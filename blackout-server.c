@@ -0,0 +1,223 @@
+/* -*- C -*- */
+/* Copyright 2024 Nikita Danilov <danilov@gmail.com> */
+/* See https://github.com/nikitadanilov/escrow/blob/master/LICENCE for the licencing information. */
+
+/*
+ * A multi-connection epoll echo server that survives restarts: on SIGTERM it
+ * checkpoints its whole epoll set (the listener and all connections) into the
+ * escrow, on start it restores the set, if there is one. On SIGINT it exits
+ * without a checkpoint and stops escrowd, dropping the connections. See
+ * blackout-client.c for the load generator measuring the blackout.
+ *
+ *     blackout-server path-to-escrow-socket [port]
+ *
+ * Linux only (epoll).
+ */
+
+#define _GNU_SOURCE /* struct ucred. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <err.h>
+#include <errno.h>
+
+#include "escrow.h"
+
+enum {
+        PORT     = 8087,
+        MAX_CONN = 1 << 16, /* Connection 0 is the listener. */
+        BATCH    = 256,
+        BUF      = 4096
+};
+
+static volatile sig_atomic_t stop = 0;
+
+static void sigterm(int signo) {
+        stop = signo;
+}
+
+static double now(void) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Stops escrowd, found as the peer of a connection to its socket. */
+static void escrowd_stop(const char *path) {
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        struct ucred       cred;
+        socklen_t          nob  = sizeof cred;
+        int                sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+        strncpy(addr.sun_path, path, sizeof addr.sun_path - 1);
+        if (sock < 0 || connect(sock, (struct sockaddr *)&addr, sizeof addr) != 0 ||
+            getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &nob) != 0 ||
+            kill(cred.pid, SIGTERM) != 0) {
+                warn("Cannot stop escrowd");
+        }
+        close(sock);
+}
+
+/* Epoll data is the index in fds[], descriptor numbers change across restarts. */
+static int fds[MAX_CONN];
+
+static int32_t conn_alloc(void) {
+        static int32_t hint = 1;
+        for (int32_t i = 0; i < MAX_CONN - 1; ++i, hint = hint % (MAX_CONN - 1) + 1) {
+                if (fds[hint] < 0) {
+                        return hint;
+                }
+        }
+        return -1;
+}
+
+static int listener(int port) {
+        int                sock;
+        int                opt     = 1;
+        struct sockaddr_in address = { .sin_family      = AF_INET,
+                                       .sin_addr.s_addr = INADDR_ANY,
+                                       .sin_port        = htons(port) };
+        if ((sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1) {
+                err(EXIT_FAILURE, "socket()");
+        }
+        if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+                err(EXIT_FAILURE, "setsockopt()");
+        }
+        if (bind(sock, (struct sockaddr *)&address, sizeof address) < 0) {
+                err(EXIT_FAILURE, "bind()");
+        }
+        if (listen(sock, SOMAXCONN) == -1) {
+                err(EXIT_FAILURE, "listen()");
+        }
+        return sock;
+}
+
+static void watch(int ep, int32_t idx) {
+        struct epoll_event ev = { .events = EPOLLIN, .data.u64 = idx };
+        if (epoll_ctl(ep, EPOLL_CTL_ADD, fds[idx], &ev) != 0) {
+                err(EXIT_FAILURE, "epoll_ctl()");
+        }
+}
+
+static void accept_all(int ep) {
+        int fd;
+        while ((fd = accept(fds[0], NULL, NULL)) >= 0) {
+                int32_t idx = conn_alloc();
+                if (idx < 0) {
+                        close(fd);
+                        continue;
+                }
+                fds[idx] = fd;
+                watch(ep, idx);
+        }
+}
+
+static void echo(int ep, int32_t idx) {
+        char    buf[BUF];
+        ssize_t nob = read(fds[idx], buf, sizeof buf);
+        if (nob <= 0 || write(fds[idx], buf, nob) != nob) {
+                epoll_ctl(ep, EPOLL_CTL_DEL, fds[idx], NULL);
+                close(fds[idx]);
+                fds[idx] = -1;
+        }
+}
+
+int main(int argc, char **argv) {
+        struct escrow      *escrow;
+        struct escrow_reg  *regs  = calloc(MAX_CONN, sizeof regs[0]);
+        struct epoll_event  ev[BATCH];
+        /* No SA_RESTART: interrupt epoll_wait(). */
+        struct sigaction    sa    = { .sa_handler = &sigterm };
+        struct rlimit       rl;
+        int32_t             nr    = MAX_CONN;
+        int                 ep;
+        int                 result;
+        double              start;
+        if (argc < 2 || regs == NULL) {
+                errx(EXIT_FAILURE, "Usage: blackout-server path-to-escrow-socket [port]");
+        }
+        if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+                rl.rlim_cur = rl.rlim_max;
+                setrlimit(RLIMIT_NOFILE, &rl);
+        }
+        signal(SIGPIPE, SIG_IGN);
+        memset(fds, -1, sizeof fds);
+        result = escrow_init(argv[1], ESCROW_CREAT | ESCROW_FORCE, 1, &escrow);
+        if (result != 0) {
+                errx(EXIT_FAILURE, "escrow_init(): %i", result);
+        }
+        /* After escrow_init(): a forked escrowd must not inherit the handlers. */
+        sigaction(SIGTERM, &sa, NULL);
+        sigaction(SIGINT, &sa, NULL);
+        start  = now();
+        result = escrow_epoll_restore(escrow, 0, &ep, &nr, regs);
+        if (result != 0) {
+                errx(EXIT_FAILURE, "escrow_epoll_restore(): %i", result);
+        }
+        for (int32_t i = 0; i < nr && i < MAX_CONN; ++i) {
+                if (regs[i].data < MAX_CONN && fds[regs[i].data] < 0) {
+                        fds[regs[i].data] = regs[i].fd;
+                } else { /* Not ours: out of range or a duplicate. */
+                        epoll_ctl(ep, EPOLL_CTL_DEL, regs[i].fd, NULL);
+                        close(regs[i].fd);
+                }
+        }
+        if (nr > 0) { /* Restored: the escrowed duplicates would keep the connections open. */
+                result = escrow_clear_except(escrow, 0, 0, NULL);
+                if (result != 0) {
+                        errx(EXIT_FAILURE, "escrow_clear_except(): %i", result);
+                }
+                fprintf(stderr, "blackout-server: restored %i connections in %.3f ms.\n",
+                        nr - 1, (now() - start) * 1e3);
+        }
+        if (fds[0] < 0) {
+                fds[0] = listener(argc > 2 ? atoi(argv[2]) : PORT);
+                watch(ep, 0);
+        }
+        while (!stop) {
+                int n = epoll_wait(ep, ev, BATCH, -1);
+                if (n < 0 && errno != EINTR) {
+                        err(EXIT_FAILURE, "epoll_wait()");
+                }
+                for (int i = 0; i < n; ++i) {
+                        if (ev[i].data.u64 == 0) {
+                                accept_all(ep);
+                        } else {
+                                echo(ep, ev[i].data.u64);
+                        }
+                }
+        }
+        if (stop == SIGINT) {
+                escrow_fini(escrow);
+                escrowd_stop(argv[1]);
+                return 0;
+        }
+        start  = now();
+        result = escrow_epoll_save(escrow, 0, ep);
+        if (result != 0) {
+                errx(EXIT_FAILURE, "escrow_epoll_save(): %i", result);
+        }
+        fprintf(stderr, "blackout-server: saved the epoll set in %.3f ms.\n",
+                (now() - start) * 1e3);
+        escrow_fini(escrow);
+        return 0;
+}
+
+/*
+ *  Local variables:
+ *  c-indentation-style: "K&R"
+ *  c-basic-offset: 8
+ *  tab-width: 8
+ *  scroll-step: 1
+ *  indent-tabs-mode: nil
+ *  End:
+ */
@@ -2,6 +2,10 @@
 /* Copyright 2024 Nikita Danilov <danilov@gmail.com> */
 /* See https://github.com/nikitadanilov/escrow/blob/master/LICENCE for the licencing information. */
 
+#if defined(__linux__)
+#define _GNU_SOURCE /* struct ucred. */
+#endif
+
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -15,8 +19,28 @@
 #include <assert.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <signal.h>
 #ifdef __linux__
 #include <sys/prctl.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAS_URING (1)
+#endif
+#if defined(SYS_pidfd_open) && defined(SYS_pidfd_getfd)
+#define HAS_PIDFD (1)
+#endif
+#if defined(MFD_CLOEXEC)
+#define HAS_MIRROR (1)
+#endif
 #endif
 #ifdef __APPLE__
 #include <string.h>
@@ -67,11 +91,12 @@ static int32_t min_32(int32_t a, int32_t b) {
         return b + ((a - b) & ((a - b) >> 31));
 }
 
-#if 0
 static int32_t max_32(int32_t a, int32_t b) {
         return a - ((a - b) & ((a - b) >> 31));
 }
 
+#if 0
+
 static int64_t min_64(int64_t a, int64_t b) {
         return b + ((a - b) & ((a - b) >> 63));
 }
@@ -83,9 +108,56 @@ static int64_t max_64(int64_t a, int64_t b) {
 
 static int send_fd(int socket, int32_t nob, const void *data, int  fd);
 static int recv_fd(int socket, int32_t nob,       void *data, int *fd);
+static int vec_send(int socket, const void *data, int32_t nob, int32_t  nr, const int *fd);
+static int vec_recv(int socket,       void *data, int32_t nob, int32_t *nr,       int *fd,
+                    int flags);
+
+union ctrl {
+        char           buf[CMSG_SPACE(sizeof (int))];
+        struct cmsghdr hdr;
+};
+
+/* A message in a batch, see io_run(). */
+struct io {
+        struct msghdr hdr;
+        struct iovec  iov[3]; /* Frame length, message header, payload. */
+        union ctrl    ctrl;
+        int32_t       len;
+        int           in;     /* Sent descriptor. */
+        int          *fd;     /* Received descriptor, NULL for a send. */
+        int           result;
+};
+
+/* A client operation observed by escrow_hooks or ESCROW_HIST. */
+struct op {
+        struct escrow_op_info info;
+        struct escrow        *e; /* NULL, unless the operation is observed. */
+};
+
+/* The observed operation this thread executes: the messages it exchanges are accounted to it. */
+static __thread struct op *op_cur;
+
+struct ring;
+
+static void         io_send (struct io *io, const void *hdr, int32_t hnob, const void *data,
+                             int32_t nob, int fd);
+static void         io_recv (struct io *io, void *buf, int32_t nob, int *fd);
+static void         io_run  (struct ring *ring, int socket, int32_t nr, struct io *io);
+static int          io_exec (int socket, struct io *io);
+static struct ring *ring_init(void);
+static void         ring_fini(struct ring *ring);
 
 static void *mem_alloc(int32_t size);
 static void  mem_free(void *mem);
+static uint64_t op_now(void);
+
+static int pid_open (pid_t pid);
+static int pid_peer (int socket);
+static int pid_getfd(int pidfd, int fd);
+static uint64_t file_id(int fd);
+
+static int32_t zip  (const uint8_t *in, int32_t nob, uint8_t *out, int32_t cap);
+static int32_t unzip(const uint8_t *in, int32_t zob, uint8_t *out, int32_t cap);
 
 enum {
         ROOT_SHIFT = 10,
@@ -103,18 +175,81 @@ static void     seq_fini(struct seq *s);
 static int      seq_add (struct seq *s, int32_t idx, void *val);
 static void     seq_del (struct seq *s, int32_t idx);
 static void    *seq_get (const struct seq *s, int32_t idx);
+static void     seq_cut (struct seq *s, int32_t idx, int32_t end, void (*cb)(void *, void *),
+                         void *arg);
 static int32_t  seq_nr  (const struct seq *s);
+static int32_t  seq_next(const struct seq *s, int32_t idx);
+
+struct lease;
 
 struct tag {
-        struct seq seq;
+        struct seq          seq;
+        struct escrow_quota use;  /* Slots, descriptors and payload bytes in the tag. */
+        struct escrow_quota max;  /* Limits on the above, 0 for none. */
+        int16_t             prio; /* Recovery priority class. */
+        int32_t             zip;  /* Compress payloads of at least that many bytes, 0 to disable. */
+        int32_t             ttl;  /* Lease of the added slots, in milliseconds, 0 for none. */
+        struct lease       *lease; /* The lease on the whole tag, or NULL. */
 };
 
 struct msg;
 struct mrep;
 
+enum {
+        ERRORS   = 64, /* Deferred failures remembered. */
+        LOBBY    = 16, /* Connections waiting for the session. */
+        WATCHERS = 4
+};
+
 struct stream {
-        uint32_t flags;
-        int      fd;
+        uint32_t     flags;
+        int          fd;
+        struct ring *ring; /* NULL, unless ESCROW_URING is set and io_uring is available. */
+};
+
+/* A connection subscribed to the changes in a tag, or in all tags, see escrow_watch(). */
+struct watcher {
+        int         fd;
+        int16_t     tag;
+        uint32_t    flags;   /* ESCROW_WATCH_DATA */
+        struct seq *dirty;   /* Per tag: the changed slots not reported yet, see watch_mark(). */
+        int32_t     nr_dirty;
+        int32_t     marks;   /* Changes since the last report. */
+        uint64_t    since;   /* Time of the first of them, see op_now(). */
+        bool        blocked; /* The connection is full, wait till it is writable. */
+        bool        synced;  /* The initial state was reported. */
+        bool        broken;  /* Out of memory, drop the watcher. */
+};
+
+struct mevt;
+
+enum {
+        WHEEL_SHIFT  = 6,
+        WHEEL_LEVELS = 5,
+        WHEEL_TICK   = 10 /* Milliseconds. */
+};
+
+/* A lease on a slot, a tag or the escrow, see @lease. */
+struct lease {
+        struct lease  *next;   /* Wheel bucket list. */
+        struct lease **prev;
+        uint64_t       expire; /* In ticks. */
+        struct slot   *slot;   /* NULL for a tag or an escrow lease. */
+        int16_t        tag;    /* ESCROW_ALL for the escrow lease. */
+};
+
+/* Hierarchical timer wheel: a bucket at level L spans 1 << (L * WHEEL_SHIFT) ticks. */
+struct wheel {
+        uint64_t      now; /* The last tick processed. */
+        struct lease *bucket[WHEEL_LEVELS][1 << WHEEL_SHIFT];
+};
+
+/* Escrowd state shared with the clients (read-only for them), see @mirror. */
+struct mirror {
+        /* Bumped when escrowd changes the slots in a way the session cannot track. */
+        uint64_t gen;
+        int32_t  nr_tags;
+        int32_t  ttl[0];  /* ESCROW_TTL of each tag. */
 };
 
 struct escrowd { /* Escrow domain representing one (restartable) client process. */
@@ -126,22 +261,102 @@ struct escrowd { /* Escrow domain representing one (restartable) client process.
         struct tag      *tags;
         struct msg       *req;
         struct mrep      *rep;
+        int                ep; /* epoll instance watching stored sockets, or -1. */
+        uint8_t         *zbuf; /* Compression buffer, MAX_PAYLOAD bytes. */
+        uint8_t         *unz;  /* Decompression buffers, BATCH * MAX_PAYLOAD bytes. */
+        struct blob   **blobs; /* Hash table of payloads. */
+        int32_t    nr_buckets; /* Size of the table, a power of 2. */
+        struct escrow_quota max; /* Limits on escrow_stats::use, 0 for none. */
+        struct owner   *owner; /* The client process, once it stored a remote slot. */
+        int            fenced; /* Session superseded by a takeover, or -1. Its requests fail. */
+        int32_t      nr_lobby;
+        int      lobby[LOBBY]; /* Accepted connections waiting for the session to end. */
+        bool    parked[LOBBY]; /* Not watched: the first request is not a takeover. */
+        int32_t      nr_watch;
+        struct watcher watch[WATCHERS];
+        struct mevt      *evt; /* Event batch buffer, allocated with the first watcher. */
+        struct wheel    wheel;
+        struct lease   *lease; /* The lease on the whole escrow, or NULL. */
+        struct mirror *mirror; /* NULL if shared memory is not available. */
+        int32_t    mirror_nob;
+        int         mirror_fd;
+        bool            quiet; /* The current request is QUIET. */
+        int32_t        nr_err; /* Failures of QUIET requests since the last SYN. */
+        struct escrow_error err[ERRORS]; /* The first ones of them. */
+        struct escrow_stats st;
+};
+
+enum slot_flags {
+        SLOT_DEAD = 1 << 0, /* The peer hung up. */
+        SLOT_KEPT = 1 << 1  /* Half-closed with unread input, not watched until handed out. */
+};
+
+/* A payload, shared by all slots with identical payloads. */
+struct blob {
+        struct blob *next; /* Hash chain. */
+        uint64_t     hash; /* escrow_hash() of the original payload. */
+        int32_t      ref;
+        int32_t      nob;  /* Original size. */
+        int32_t      zob;  /* Stored size. */
+        bool         zip;  /* The payload is compressed. */
+        uint8_t      data[0];
+};
+
+/*
+ * A client process that keeps the descriptors of its remote slots itself
+ * (ESCROW_PIDFD). Shared by these slots.
+ */
+struct owner {
+        int     pidfd;
+        int32_t ref;
 };
 
 struct slot {
-        int     fd;
-        int     ufd;
-        int32_t nob;
-        uint8_t data[0];
+        int      fd;      /* -1 for a remote slot. */
+        int      ufd;     /* The client's descriptor number, for a remote slot: in the owner. */
+        int16_t  tag;
+        uint16_t flags;
+        int32_t  idx;
+        uint16_t ready;   /* Readiness, as of the last slot_ready(). */
+        int32_t  pending; /* Bytes of input pending, ditto. */
+        int32_t  nob;
+        uint64_t fid;     /* file_id() of the descriptor of a remote slot, as the owner added it. */
+        struct blob  *blob;  /* NULL for an empty payload. */
+        struct owner *owner; /* Non-NULL for a remote slot. */
+        struct lease *lease;
 };
 
 enum {
         QUEUE       = 16,
+        BATCH       = 32,
+        POLL_CHUNK  = 1 << 10,
         MAX_PAYLOAD = 1 << 15,
         MAX_REPLY   = 1 << 10,
-        FORK_DELAY  = 1
+        FORK_DELAY  = 1,
+        BUCKETS     = 1 << 10,
+        FD_SLACK    = 64, /* Descriptors escrowd needs beyond the stored ones. */
+        VEC_MAX     = 250, /* Descriptors in a VEC message, Linux SCM_MAX_FD is 253. */
+        CLR_MAX     = MAX_PAYLOAD / (2 * sizeof(int32_t)), /* Ranges in a CLR message. */
+        WATCH_LAG   = 1 << 10, /* Changes after which a watcher is reported to without waiting. */
+        WAIT_EVERY  = 64, /* Requests received back to back, without escrowd_wait(), at most. */
+        WATCH_DELAY = 10  /* Milliseconds a change waits to be coalesced with the following ones. */
+};
+
+/* Values in watcher::dirty: whether the slot was present when it was first changed. */
+enum {
+        DIRTY_NEW = 1,
+        DIRTY_OLD = 2
 };
 
+#if defined(__APPLE__)
+/* Darwin has no SOCK_SEQPACKET for UNIX domain sockets, messages are framed explicitly. */
+#define SOCK_TYPE SOCK_STREAM
+#define FRAMED    (true)
+#else
+#define SOCK_TYPE SOCK_SEQPACKET
+#define FRAMED    (false)
+#endif
+
 enum opcode {
         HEL,
         ADD,
@@ -149,7 +364,33 @@ enum opcode {
         REP,
         TAG,
         INF,
-        GET
+        GET,
+        SET,
+        REC,
+        END,
+        STA,
+        STS,
+        REF,
+        MAN,
+        RUN,
+        SYN,
+        ERR,
+        VEC,
+        VGT,
+        TKO,
+        CLR,
+        WCH,
+        EVT,
+        LSE,
+        DMP,
+        FNC, /* Sent unsolicited to a session once it is fenced. */
+        /*
+         * Flag: the descriptor stays in the client, ADD carries its number
+         * only. In ADD replies: the passed descriptor is the owner's pidfd.
+         */
+        REMOTE = 1 << 13,
+        /* Flag: escrowd replies only on failure, and defers the failure till the next SYN. */
+        QUIET  = 1 << 14
 };
 
 struct mhel {
@@ -160,14 +401,31 @@ struct mhel {
 };
 
 struct madd {
-        int16_t opcode;
-        int16_t tag;
-        int32_t idx;
-        int32_t ufd;
-        int32_t nob;
-        uint8_t data[MAX_PAYLOAD];
+        int16_t  opcode;
+        int16_t  tag;
+        int32_t  idx;
+        int32_t  ufd;
+        int32_t  nob;
+        uint32_t ready;   /* Replies only: readiness of the descriptor. */
+        int32_t  pending; /* Replies only: bytes of input pending. */
+        uint64_t fid;     /* Remote slots only: file_id() of the descriptor. */
+        uint8_t  data[MAX_PAYLOAD];
+};
+
+/* Header of an ADD message, sent separately from the payload in batches. */
+struct mslot {
+        int16_t  opcode;
+        int16_t  tag;
+        int32_t  idx;
+        int32_t  ufd;
+        int32_t  nob;
+        uint32_t ready;
+        int32_t  pending;
+        uint64_t fid;
 };
 
+SASSERT(sizeof(struct mslot) == offsetof(struct madd, data));
+
 struct mdel {
         int16_t opcode;
         int16_t tag;
@@ -193,12 +451,167 @@ struct minf {
         int32_t total;
 };
 
+enum mget_flags {
+        GET_READY = 1 << 0, /* Return readiness. */
+        GET_PULL  = 1 << 1  /* Fetch the descriptor of a remote slot from its owner and keep it. */
+};
+
 struct mget {
+        int16_t  opcode;
+        int16_t  tag;
+        int32_t  idx;
+        uint32_t flags;
+};
+
+struct mset {
+        int16_t opcode;
+        int16_t tag;
+        int16_t attr;
+        int16_t pad;
+        int32_t val;
+};
+
+enum mrec_flags {
+        REC_PULL = 1 << 0 /* Fetch the remote descriptors from their owners first, as GET_PULL. */
+};
+
+struct mrec {
+        int16_t opcode;
+        int16_t flags;
+        int32_t prio;
+};
+
+struct mend {
+        int16_t opcode;
+        int16_t pad;
+        int32_t prio;
+        int32_t nr;
+};
+
+struct msta {
+        int16_t             opcode;
+        int16_t             pad[3];
+        struct escrow_stats stats;
+};
+
+/* As ADD, but the payload is an already stored blob. */
+struct mref {
+        int16_t  opcode;
+        int16_t  tag;
+        int32_t  idx;
+        int32_t  ufd;
+        int32_t  pad;
+        uint64_t hash;
+};
+
+/* A run of present indices, followed by mrun::nr uint16_t payload sizes, in a RUN message. */
+struct mrun {
+        int16_t  tag;
+        uint16_t flags; /* ESCROW_RUN_FD */
+        int32_t  idx;
+        int32_t  nr;
+};
+
+/* MAN request (nob is 0) and RUN replies, packed struct mrun records. */
+struct mman {
+        int16_t opcode;
+        int16_t pad;
+        int32_t nob;
+        uint8_t data[MAX_PAYLOAD];
+};
+
+/* SYN request (nr is 0) and ERR reply: the failures deferred since the last SYN. */
+struct merr {
+        int16_t             opcode;
+        int16_t             pad;
+        int32_t             nr;
+        struct escrow_error err[ERRORS];
+};
+
+/*
+ * A batch of descriptors, passed together in a single SCM_RIGHTS message, with
+ * their epoll registrations: a VEC request stores them in consecutive indices
+ * starting from idx, VEC replies to VGT carry the descriptors of the tag.
+ */
+struct mvec {
+        int16_t           opcode;
+        int16_t           tag;
+        int32_t           idx;
+        int32_t           nr;
+        int32_t           pad;
+        struct escrow_reg reg[VEC_MAX];
+};
+
+/* Deletes the slots in the ranges of indices of the tag, or of all tags with ESCROW_ALL. */
+struct mclr {
+        int16_t opcode;
+        int16_t tag;
+        int32_t nr;
+        struct {
+                int32_t idx;
+                int32_t end; /* Exclusive. */
+        } range[CLR_MAX];
+};
+
+/* Sets a lease, starts as mdel. */
+struct mlse {
         int16_t opcode;
         int16_t tag;
         int32_t idx;
+        int32_t ttl;
+};
+
+/* A record in a DMP message, followed by the payload. */
+struct mdrec {
+        int16_t tag;
+        int16_t pad;
+        int32_t idx;
+        int32_t ufd; /* The descriptor is passed, unless negative. */
+        int32_t nob;
+};
+
+/*
+ * Emergency dump batch, see escrow_dump(). The descriptors are passed in the order of
+ * their records.
+ */
+struct mdmp {
+        int16_t opcode;
+        int16_t pad;
+        int32_t nr;
+        int32_t nob;
+        uint8_t data[MAX_PAYLOAD];
+};
+
+SASSERT(sizeof(struct mdmp) <= sizeof(struct madd));
+SASSERT(ESCROW_DUMP_MAX + sizeof(struct mdrec) == MAX_PAYLOAD);
+
+/* Subscribes to the changes in the tag, see escrow_watch(). */
+struct mwch {
+        int16_t  opcode;
+        int16_t  tag;
+        uint32_t flags;
+};
+
+/* An event record in an EVT message, followed by the payload with ESCROW_WATCH_DATA. */
+struct mev {
+        int16_t  type;
+        int16_t  tag;
+        int32_t  idx;
+        int32_t  nob;
+        uint16_t flags;
+        uint16_t pad;
 };
 
+/* A batch of packed event records. Room for one more record, so that a maximal payload fits. */
+struct mevt {
+        int16_t opcode;
+        int16_t pad;
+        int32_t nob;
+        uint8_t data[MAX_PAYLOAD + sizeof(struct mev)];
+};
+
+SASSERT(sizeof(struct mevt) <= sizeof(struct madd));
+
 struct msg {
         union {
                 int16_t opcode;
@@ -209,13 +622,28 @@ struct msg {
                 struct mtag tag;
                 struct minf inf;
                 struct mget get;
+                struct mset set;
+                struct mrec rec;
+                struct mend end;
+                struct msta sta;
+                struct mref ref;
+                struct mman man;
+                struct merr err;
+                struct mvec vec;
+                struct mclr clr;
+                struct mwch wch;
+                struct mevt evt;
+                struct mlse lse;
+                struct mdmp dmp;
         };
 };
 
 /* @msg */
 
 static int32_t msize(const struct msg *m) {
-        switch (m->opcode) {
+        switch (m->opcode & ~(QUIET | REMOTE)) {
+        case HEL:
+                return sizeof m->hel;
         case ADD:
                 return offsetof(struct madd, data) + m->add.nob;
         case DEL:
@@ -228,13 +656,59 @@ static int32_t msize(const struct msg *m) {
                 return sizeof m->inf;
         case GET:
                 return sizeof m->get;
+        case SET:
+                return sizeof m->set;
+        case REC:
+                return sizeof m->rec;
+        case END:
+                return sizeof m->end;
+        case STA:
+                return offsetof(struct msta, stats);
+        case STS:
+                return sizeof m->sta;
+        case REF:
+                return sizeof m->ref;
+        case MAN:
+        case RUN:
+                return offsetof(struct mman, data) + m->man.nob;
+        case SYN:
+        case ERR:
+                return offsetof(struct merr, err) +
+                        min_32(m->err.nr, ERRORS) * sizeof m->err.err[0];
+        case VEC:
+                return offsetof(struct mvec, reg) +
+                        min_32(m->vec.nr, VEC_MAX) * sizeof m->vec.reg[0];
+        case VGT:
+        case TKO:
+        case FNC:
+                return sizeof m->tag;
+        case CLR:
+                return offsetof(struct mclr, range) +
+                        min_32(m->clr.nr, CLR_MAX) * sizeof m->clr.range[0];
+        case WCH:
+                return sizeof m->wch;
+        case EVT:
+                return offsetof(struct mevt, data) + m->evt.nob;
+        case LSE:
+                return sizeof m->lse;
+        case DMP:
+                return offsetof(struct mdmp, data) + m->dmp.nob;
         }
         ASSERT("Wrong opcode.");
         return 0;
 }
 
 static void mprint(const struct msg *m) {
-        switch (m->opcode) {
+        if (m->opcode & QUIET) {
+                OUT("~");
+        }
+        if (m->opcode & REMOTE) {
+                OUT("@");
+        }
+        switch (m->opcode & ~(QUIET | REMOTE)) {
+        case HEL:
+                OUT("{HEL %3i}", m->hel.nr_tags);
+                break;
         case ADD:
                 OUT("{ADD %3i %3i %3i %4i}", m->add.tag, m->add.idx, m->add.ufd, m->add.nob);
                 break;
@@ -253,6 +727,69 @@ static void mprint(const struct msg *m) {
         case GET:
                 OUT("{GET %3i %3i}", m->get.tag, m->get.idx);
                 break;
+        case SET:
+                OUT("{SET %3i %3i %4i}", m->set.tag, m->set.attr, m->set.val);
+                break;
+        case REC:
+                OUT("{REC %3i %x}", m->rec.prio, m->rec.flags);
+                break;
+        case END:
+                OUT("{END %3i %4i}", m->end.prio, m->end.nr);
+                break;
+        case STA:
+                OUT("{STA}");
+                break;
+        case STS:
+                OUT("{STS %3lli %3lli %3lli %3lli %6lli %6lli %4lli %6lli %4i %4i %6lli}",
+                    (long long)m->sta.stats.nr_dead, (long long)m->sta.stats.nr_reaped,
+                    (long long)m->sta.stats.nr_expired, (long long)m->sta.stats.nr_leases,
+                    (long long)m->sta.stats.zip_raw, (long long)m->sta.stats.zip_packed,
+                    (long long)m->sta.stats.nr_blobs, (long long)m->sta.stats.blob_saved,
+                    m->sta.stats.use.slots, m->sta.stats.use.fds, (long long)m->sta.stats.use.nob);
+                break;
+        case REF:
+                OUT("{REF %3i %3i %3i %016llx}", m->ref.tag, m->ref.idx, m->ref.ufd,
+                    (unsigned long long)m->ref.hash);
+                break;
+        case MAN:
+                OUT("{MAN}");
+                break;
+        case RUN:
+                OUT("{RUN %5i}", m->man.nob);
+                break;
+        case SYN:
+                OUT("{SYN}");
+                break;
+        case ERR:
+                OUT("{ERR %4i}", m->err.nr);
+                break;
+        case VEC:
+                OUT("{VEC %3i %3i %3i}", m->vec.tag, m->vec.idx, m->vec.nr);
+                break;
+        case VGT:
+                OUT("{VGT %3i}", m->tag.tag);
+                break;
+        case TKO:
+                OUT("{TKO}");
+                break;
+        case FNC:
+                OUT("{FNC}");
+                break;
+        case CLR:
+                OUT("{CLR %3i %4i}", m->clr.tag, m->clr.nr);
+                break;
+        case WCH:
+                OUT("{WCH %3i %x}", m->wch.tag, m->wch.flags);
+                break;
+        case EVT:
+                OUT("{EVT %5i}", m->evt.nob);
+                break;
+        case LSE:
+                OUT("{LSE %3i %4i %6i}", m->lse.tag, m->lse.idx, m->lse.ttl);
+                break;
+        case DMP:
+                OUT("{DMP %4i %6i}", m->dmp.nr, m->dmp.nob);
+                break;
         default:
                 OUT("{UNKNOWN %i}", m->opcode);
         }
@@ -278,512 +815,4503 @@ static int msend(const struct stream *s, const struct msg *m, int in) {
         return result;
 }
 
+/*
+ * As mrecv(), but accepts up to VEC_MAX descriptors, their number is returned
+ * in *NR. FLAGS are passed to recvmsg(2).
+ */
+static int mrecvv(const struct stream *s, struct msg *m, int32_t *nr, int *fd, int flags) {
+        int result;
+        SET0(m);
+        result = vec_recv(s->fd, m, sizeof *m, nr, fd, flags);
+        EV(s->flags, mshow("recv", m, *nr > 0 ? fd[0] : -1, result));
+        return result;
+}
+
+static int msendv(const struct stream *s, const struct msg *m, int32_t nr, const int *fd) {
+        int result = vec_send(s->fd, m, msize(m), nr, fd);
+        EV(s->flags, mshow("send", m, nr > 0 ? fd[0] : -1, result));
+        return result;
+}
+
+/* Sends and receives a batch of messages, in order. */
+static void mrun(const struct stream *s, int32_t nr, struct io *io) {
+        io_run(s->ring, s->fd, nr, io);
+        for (int32_t i = 0; i < nr; ++i) {
+                EV(s->flags, mshow(io[i].fd == NULL ? "send" : "recv", io[i].iov[1].iov_base,
+                                   io[i].fd == NULL ? io[i].in : *io[i].fd, io[i].result));
+        }
+}
+
+/*
+ * Sends NR requests and receives their replies in one batch: io[0 .. NR) are the
+ * sends and io[NR .. 2*NR) the matching receives. Requests cancelled by a
+ * failure of an earlier one are re-tried one by one, so that each request
+ * either fails on its own or gets its reply and the connection stays in sync.
+ */
+static void mcall(const struct stream *s, int32_t nr, struct io *io) {
+        mrun(s, 2 * nr, io);
+        for (int32_t i = 0; i < nr; ++i) {
+                struct io *req = &io[i];
+                struct io *rep = &io[nr + i];
+                if (req->result == -ECANCELED) {
+                        req->result = io_exec(s->fd, req);
+                        rep->result = -ECANCELED;
+                }
+                if (req->result == 0 && rep->result == -ECANCELED) {
+                        SET0(&rep->ctrl);
+                        rep->result = io_exec(s->fd, rep);
+                }
+        }
+}
+
 static bool m_is_valid(const struct escrowd *d, int16_t tag, int32_t idx, int16_t ufd) {
         return 0 <= tag && tag < d->nr_tags && 0 <= idx && idx < MAX_IDX && ufd >= 0;
 }
 
-static int reply(struct escrowd *d, int16_t rc, const char *descr) {
+/* Replies on a connection, not necessarily the session. */
+static int reply_on(struct escrowd *d, int fd, int16_t rc, const char *descr) {
+        struct stream s = { .flags = d->stream.flags, .fd = fd };
         ASSERT(strlen(descr) + 1 <= ARRAY_SIZE(d->rep->data));
         d->rep->opcode = REP;
         d->rep->rc     = rc;
         d->rep->nob    = strlen(descr) + 1;
         strcpy((void *)d->rep->data, descr);
-        return msend(&d->stream, (void *)d->rep, -1);
+        return msend(&s, (void *)d->rep, -1);
+}
+
+/* Invalidates the shadows of the clients, see @mirror. */
+static void mirror_bump(struct escrowd *d) {
+        if (d->mirror != NULL) {
+                __atomic_store_n(&d->mirror->gen, d->mirror->gen + 1, __ATOMIC_RELEASE);
+        }
+}
+
+/* Remembers a failure of a QUIET request, till the next SYN. */
+static void defer(struct escrowd *d, int16_t tag, int32_t idx, int16_t rc) {
+        mirror_bump(d); /* The client assumed success. */
+        if (d->nr_err++ < ERRORS) {
+                d->err[d->nr_err - 1] = (struct escrow_error){ .tag = tag, .idx = idx, .rc = rc };
+        }
+}
+
+static int reply(struct escrowd *d, int16_t rc, const char *descr) {
+        if (d->quiet) { /* ADD, DEL, REF, VEC or LSE: all start with the tag and the index. */
+                if (rc != 0) {
+                        defer(d, d->req->del.tag, d->req->del.idx, rc);
+                }
+                return 0;
+        }
+        return reply_on(d, d->stream.fd, rc, descr);
 }
 
 static int ok(struct escrowd *d) {
         return reply(d, 0, "");
 }
 
-static void slot_fini(struct slot *s) {
-        close(s->fd);
-        mem_free(s);
+static void reap_add(struct escrowd *d, struct slot *s);
+static void reap_del(struct escrowd *d, struct slot *s);
+static void reap_rearm(struct escrowd *d, struct slot *s);
+static void watch_mark(struct escrowd *d, int16_t tag, int32_t idx, bool existed);
+static int  lease_set(struct escrowd *d, struct lease **lease, struct slot *slot, int16_t tag,
+                      int32_t ttl);
+static void lease_del(struct escrowd *d, struct lease *lease);
+
+static struct blob **blob_bucket(struct escrowd *d, uint64_t hash) {
+        return &d->blobs[hash & (d->nr_buckets - 1)];
 }
 
-static int add(struct escrowd *d, const struct madd *m, int fd) {
-        struct slot *s;
-        int          result;
-        ASSERT(m->opcode == ADD);
-        ASSERT(fd >= 0);
-        if (UNLIKELY(!m_is_valid(d, m->tag, m->idx, m->ufd) || m->nob < 0 || m->nob > MAX_PAYLOAD)) {
-                return reply(d, -EINVAL, "Wrong ADD request.");
-        }
-        s = seq_get(&d->tags[m->tag].seq, m->idx);
-        if (s != NULL) {
-                slot_fini(s);
+/* Returns the original payload, decompressed into BUF if necessary. */
+static const uint8_t *blob_data(const struct blob *b, uint8_t *buf) {
+        int32_t nob;
+        if (!b->zip) {
+                return b->data;
         }
-        s = mem_alloc(sizeof *s + m->nob);
-        if (UNLIKELY(s == NULL)) {
-                return reply(d, -ENOMEM, "Cannot allocate a slot.");
+        nob = unzip(b->data, b->zob, buf, MAX_PAYLOAD);
+        ASSERT(nob == b->nob);
+        return buf;
+}
+
+/* Looks a blob up by the hash and, unless DATA is NULL, by the contents. */
+static struct blob *blob_find(struct escrowd *d, uint64_t hash, int32_t nob, const uint8_t *data) {
+        if (d->blobs == NULL) {
+                return NULL;
         }
-        s->fd  = fd;
-        s->ufd = m->ufd;
-        s->nob = m->nob;
-        memcpy(&s->data, &m->data, m->nob);
-        result = seq_add(&d->tags[m->tag].seq, m->idx, s);
-        if (result != 0) {
-                return reply(d, result, "Cannot extend a sequence.");
+        for (struct blob *b = *blob_bucket(d, hash); b != NULL; b = b->next) {
+                if (b->hash == hash && (data == NULL ||
+                                        (b->nob == nob &&
+                                         memcmp(blob_data(b, d->unz), data, nob) == 0))) {
+                        return b;
+                }
         }
-        return ok(d);
+        return NULL;
 }
 
-static int del(struct escrowd *d, const struct mdel *m, int fd) {
-        struct slot *s;
-        ASSERT(m->opcode == DEL);
-        if (UNLIKELY(!m_is_valid(d, m->tag, m->idx, 0))) {
-                return reply(d, -EINVAL, "Wrong DEL request.");
+static void blob_hold(struct escrowd *d, struct blob *b) {
+        ++b->ref;
+        d->st.blob_saved += b->nob;
+}
+
+static void blob_put(struct escrowd *d, struct blob *b) {
+        struct blob **p;
+        if (--b->ref > 0) {
+                d->st.blob_saved -= b->nob;
+                return;
         }
-        if (fd != -1) {
-                return reply(d, -EINVAL, "Descriptor present in a DEL request.");
+        for (p = blob_bucket(d, b->hash); *p != b; p = &(*p)->next) {
+                ;
         }
-        s = seq_get(&d->tags[m->tag].seq, m->idx);
-        if (UNLIKELY(s == NULL)) {
-                return reply(d, -EINVAL, "Non-existent index in DEL request.");
+        *p = b->next;
+        --d->st.nr_blobs;
+        if (b->zip) {
+                d->st.zip_raw    -= b->nob;
+                d->st.zip_packed -= b->zob;
         }
-        seq_del(&d->tags[m->tag].seq, m->idx);
-        slot_fini(s);
-        return ok(d);
+        mem_free(b);
 }
 
-static int tag(struct escrowd *d, const struct mtag *m, int fd) {
-        struct tag *t    = &d->tags[m->tag];
-        struct minf info = {};
-        int32_t     max;
-        ASSERT(m->opcode == TAG);
-        if (UNLIKELY(!m_is_valid(d, m->tag, 0, 0))) {
-                return reply(d, -EINVAL, "Wrong TAG request.");
-        }
-        if (fd != -1) {
-                return reply(d, -EINVAL, "Descriptor present in a TAG request.");
+/* Doubles the hash table. */
+static int blob_grow(struct escrowd *d) {
+        int32_t       nr    = d->nr_buckets != 0 ? 2 * d->nr_buckets : BUCKETS;
+        struct blob **blobs = mem_alloc(nr * sizeof blobs[0]);
+        if (blobs == NULL) {
+                return -ENOMEM;
         }
-        max = seq_nr(&t->seq);
-        info.opcode = INF;
-        for (int32_t i = 0; i < max; ++i) {
-                struct slot *s = seq_get(&t->seq, i);
-                if (s != NULL) {
-                        ++info.nr;
-                        info.total += s->nob;
+        for (int32_t i = 0; i < d->nr_buckets; ++i) {
+                struct blob *next;
+                for (struct blob *b = d->blobs[i]; b != NULL; b = next) {
+                        next = b->next;
+                        b->next = blobs[b->hash & (nr - 1)];
+                        blobs[b->hash & (nr - 1)] = b;
                 }
         }
-        return msend(&d->stream, (void *)&info, -1);
+        mem_free(d->blobs);
+        d->blobs      = blobs;
+        d->nr_buckets = nr;
+        return 0;
 }
 
-static int get(struct escrowd *d, const struct mget *m, int fd) {
-        struct slot *s;
-        struct madd  add;
-        ASSERT(m->opcode == GET);
-        if (UNLIKELY(!m_is_valid(d, m->tag, m->idx, 0))) {
-                return reply(d, -EINVAL, "Wrong DEL request.");
+static int32_t add_zip(struct escrowd *d, const struct tag *t, const uint8_t *data, int32_t nob);
+
+/* Returns a held blob with the payload of M, stored (and compressed) anew if necessary. */
+static struct blob *blob_get(struct escrowd *d, const struct tag *t, const uint8_t *data,
+                             int32_t nob) {
+        uint64_t      hash = escrow_hash(data, nob);
+        struct blob  *b    = blob_find(d, hash, nob, data);
+        struct blob **bucket;
+        int32_t       zob;
+        if (b != NULL) {
+                blob_hold(d, b);
+                return b;
         }
-        if (fd != -1) {
-                return reply(d, -EINVAL, "Descriptor present in a GET request.");
+        if (d->st.nr_blobs >= d->nr_buckets && blob_grow(d) != 0 && d->blobs == NULL) {
+                return NULL; /* A full table is still usable, the chains are just longer. */
         }
-        s = seq_get(&d->tags[m->tag].seq, m->idx);
-        if (UNLIKELY(s == NULL)) {
-                return reply(d, -ENOENT, "Non-existent index in a GET request.");
+        zob = add_zip(d, t, data, nob);
+        b = mem_alloc(sizeof *b + (zob >= 0 ? zob : nob));
+        if (UNLIKELY(b == NULL)) {
+                return NULL;
+        }
+        b->hash = hash;
+        b->ref  = 1;
+        b->nob  = nob;
+        if (zob >= 0) {
+                b->zob = zob;
+                b->zip = true;
+                memcpy(&b->data, d->zbuf, zob);
+                d->st.zip_raw    += b->nob;
+                d->st.zip_packed += b->zob;
+        } else {
+                b->zob = nob;
+                memcpy(&b->data, data, nob);
         }
-        add.opcode = ADD;
-        add.tag    = m->tag;
-        add.idx    = m->idx;
-        add.ufd    = s->ufd;
-        add.nob    = s->nob;
-        memcpy(add.data, s->data, s->nob);
-        return msend(&d->stream, (void *)&add, s->fd);
+        bucket = blob_bucket(d, hash);
+        b->next = *bucket;
+        *bucket = b;
+        ++d->st.nr_blobs;
+        return b;
 }
 
-/* @daemon */
+static void owner_put(struct owner *o) {
+        if (o != NULL && --o->ref == 0) {
+                close(o->pidfd);
+                mem_free(o);
+        }
+}
 
-int escrowd_init(struct escrowd **out, const char *path, uint32_t flags, int32_t nr_tags) {
-        struct sockaddr_un address;
-        int                result;
-        mode_t             mask;
-        struct tag        *tags = mem_alloc(nr_tags * sizeof tags[0]);
-        struct escrowd    *d    = mem_alloc(sizeof *d);
-        if (d == NULL || tags == NULL) {
+/*
+ * Returns the owner for the remote slots of the current session, NULL if
+ * pidfds are not available, or escrowd may not fetch the descriptors of the
+ * client (UFD, for a try), as then nobody might be able to.
+ */
+static struct owner *owner_get(struct escrowd *d, int32_t ufd) {
+        if (d->owner == NULL) {
+                int pidfd = pid_peer(d->stream.fd);
+                int fd    = pidfd >= 0 ? pid_getfd(pidfd, ufd) : -1;
+                if (fd >= 0) {
+                        close(fd);
+                } else if (pidfd >= 0) {
+                        close(pidfd);
+                        pidfd = -1;
+                }
+                if (pidfd >= 0) {
+                        d->owner = mem_alloc(sizeof *d->owner);
+                        if (d->owner != NULL) {
+                                *d->owner = (struct owner){ .pidfd = pidfd, .ref = 1 };
+                        } else {
+                                close(pidfd);
+                        }
+                }
+        }
+        return d->owner;
+}
+
+static void slot_fini(struct escrowd *d, struct slot *s) {
+        if (s->fd >= 0) {
+                reap_del(d, s);
+                close(s->fd);
+        }
+        owner_put(s->owner);
+        lease_del(d, s->lease);
+        if (s->flags & SLOT_DEAD) {
+                --d->st.nr_dead;
+        }
+        if (s->blob != NULL) {
+                blob_put(d, s->blob);
+        }
+        mem_free(s);
+}
+
+static void use_add(struct escrow_quota *use, int32_t slots, int32_t fds, int64_t nob) {
+        use->slots += slots;
+        use->fds   += fds;
+        use->nob   += nob;
+}
+
+/* Accounts for the slot, SIGN is +1 on insertion and -1 on removal. */
+static void slot_use(struct escrowd *d, const struct slot *s, int32_t sign) {
+        use_add(&d->tags[s->tag].use, sign, sign * (s->fd >= 0), sign * s->nob);
+        use_add(&d->st.use,           sign, sign * (s->fd >= 0), sign * s->nob);
+}
+
+/* Returns true if adding the deltas to USE keeps it within MAX. Shrinking is always allowed. */
+static bool use_fits(const struct escrow_quota *use, const struct escrow_quota *max,
+                     int32_t slots, int32_t fds, int64_t nob) {
+        return (max->slots == 0 || slots <= 0 || use->slots + slots <= max->slots) &&
+               (max->fds   == 0 || fds   <= 0 || use->fds   + fds   <= max->fds)   &&
+               (max->nob   == 0 || nob   <= 0 || use->nob   + nob   <= max->nob);
+}
+
+/*
+ * Checks the quotas for a slot with FD and NOB bytes of payload, replacing the
+ * one at IDX, if any. Returns NULL or the description of the exceeded quota.
+ */
+static const char *over_quota(struct escrowd *d, int16_t tag, int32_t idx, int fd, int32_t nob) {
+        struct tag  *t     = &d->tags[tag];
+        struct slot *old   = seq_get(&t->seq, idx);
+        int32_t      slots = old == NULL;
+        int32_t      fds   = (fd >= 0) - (old != NULL && old->fd >= 0);
+        int64_t      dnob  = nob - (old != NULL ? old->nob : 0);
+        return !use_fits(&t->use,    &t->max, slots, fds, dnob) ? "Tag quota exceeded."    :
+               !use_fits(&d->st.use, &d->max, slots, fds, dnob) ? "Escrow quota exceeded." : NULL;
+}
+
+/* Removes the slot from its tag and frees it. */
+static void slot_del(struct escrowd *d, struct slot *s) {
+        watch_mark(d, s->tag, s->idx, true);
+        seq_del(&d->tags[s->tag].seq, s->idx);
+        slot_use(d, s, -1);
+        slot_fini(d, s);
+}
+
+/*
+ * Compresses the payload into d->zbuf, if enabled and worthwhile. Returns the
+ * compressed size or -1.
+ */
+static int32_t add_zip(struct escrowd *d, const struct tag *t, const uint8_t *data, int32_t nob) {
+        if (t->zip == 0 || nob < t->zip) {
+                return -1;
+        }
+        return zip(data, nob, d->zbuf, nob - (nob >> 3)); /* Save at least 1/8th. */
+}
+
+/*
+ * Stores the descriptor with the (held) blob, replacing the slot with the same
+ * index, if any. On a failure, releases the descriptor and the blob and returns
+ * the error, described in *WHY.
+ */
+static int slot_put(struct escrowd *d, int16_t tag, int32_t idx, int32_t ufd, int fd,
+                    struct blob *b, const char **why) {
+        struct tag  *t = &d->tags[tag];
+        struct slot *s = seq_get(&t->seq, idx);
+        int          result;
+        watch_mark(d, tag, idx, s != NULL);
+        if (s != NULL) {
+                slot_del(d, s);
+        }
+        s = mem_alloc(sizeof *s);
+        if (UNLIKELY(s == NULL)) {
+                if (fd >= 0) {
+                        close(fd);
+                }
+                if (b != NULL) {
+                        blob_put(d, b);
+                }
+                *why = "Cannot allocate a slot.";
+                return -ENOMEM;
+        }
+        s->fd   = fd;
+        s->ufd  = ufd;
+        s->tag  = tag;
+        s->idx  = idx;
+        s->nob  = b != NULL ? b->nob : 0;
+        s->blob = b;
+        result = t->ttl > 0 ? lease_set(d, &s->lease, s, tag, t->ttl) : 0;
+        if (result != 0) {
+                slot_fini(d, s);
+                *why = "Cannot allocate a lease.";
+                return result;
+        }
+        result = seq_add(&t->seq, idx, s);
+        if (result != 0) {
+                slot_fini(d, s);
+                *why = "Cannot extend a sequence.";
+                return result;
+        }
+        slot_use(d, s, +1);
+        if (fd >= 0) {
+                reap_add(d, s);
+        }
+        return 0;
+}
+
+/* Stores the descriptor and the payload, as slot_put(). */
+static int store(struct escrowd *d, int16_t tag, int32_t idx, int32_t ufd, int fd,
+                 const uint8_t *data, int32_t nob, const char **why) {
+        struct blob *b = NULL;
+        *why = over_quota(d, tag, idx, fd, nob);
+        if (UNLIKELY(*why != NULL)) {
+                if (fd >= 0) {
+                        close(fd);
+                }
+                return -EDQUOT;
+        }
+        if (nob > 0) {
+                b = blob_get(d, &d->tags[tag], data, nob);
+                if (UNLIKELY(b == NULL)) {
+                        if (fd >= 0) {
+                                close(fd);
+                        }
+                        *why = "Cannot allocate a payload.";
+                        return -ENOMEM;
+                }
+        }
+        return slot_put(d, tag, idx, ufd, fd, b, why);
+}
+
+static int add(struct escrowd *d, const struct madd *m, int fd) {
+        const char *why = "";
+        int         rc;
+        ASSERT(m->opcode == ADD);
+        if (UNLIKELY(!m_is_valid(d, m->tag, m->idx, 0) || (m->ufd < 0) != (fd < 0) ||
+                     m->nob < 0 || m->nob > MAX_PAYLOAD)) {
+                if (fd >= 0) {
+                        close(fd);
+                }
+                return reply(d, -EINVAL, "Wrong ADD request.");
+        }
+        rc = store(d, m->tag, m->idx, m->ufd, fd, m->data, m->nob, &why);
+        return reply(d, rc, rc == 0 ? "" : why);
+}
+
+/*
+ * As add(), but the descriptor stays in the client (ESCROW_PIDFD): only its
+ * number is stored, together with the pidfd of the client, through which the
+ * retrieving process fetches the descriptor directly.
+ */
+static int add_remote(struct escrowd *d, const struct madd *m, int fd) {
+        struct owner *o;
+        const char   *why = "";
+        int           rc;
+        ASSERT(m->opcode == ADD);
+        if (UNLIKELY(!m_is_valid(d, m->tag, m->idx, 0) || m->ufd < 0 || fd >= 0 ||
+                     m->nob < 0 || m->nob > MAX_PAYLOAD)) {
+                if (fd >= 0) {
+                        close(fd);
+                }
+                return reply(d, -EINVAL, "Wrong remote ADD request.");
+        }
+        o = owner_get(d, m->ufd);
+        if (o == NULL) {
+                return reply(d, -EOPNOTSUPP, "Cannot fetch descriptors from the client.");
+        }
+        rc = store(d, m->tag, m->idx, m->ufd, -1, m->data, m->nob, &why);
+        if (rc == 0) {
+                struct slot *s = seq_get(&d->tags[m->tag].seq, m->idx);
+                s->owner = o;
+                s->fid   = m->fid;
+                ++o->ref;
+        }
+        return reply(d, rc, rc == 0 ? "" : why);
+}
+
+static int ref(struct escrowd *d, const struct mref *m, int fd) {
+        struct blob *b;
+        const char  *why;
+        int          rc;
+        ASSERT(m->opcode == REF);
+        if (UNLIKELY(!m_is_valid(d, m->tag, m->idx, 0) || (m->ufd < 0) != (fd < 0))) {
+                if (fd >= 0) {
+                        close(fd);
+                }
+                return reply(d, -EINVAL, "Wrong REF request.");
+        }
+        b = blob_find(d, m->hash, 0, NULL);
+        if (b == NULL) {
+                if (fd >= 0) {
+                        close(fd);
+                }
+                return reply(d, -ENOENT, "Unknown payload in a REF request.");
+        }
+        why = over_quota(d, m->tag, m->idx, fd, b->nob);
+        if (UNLIKELY(why != NULL)) {
+                if (fd >= 0) {
+                        close(fd);
+                }
+                return reply(d, -EDQUOT, why);
+        }
+        blob_hold(d, b);
+        rc = slot_put(d, m->tag, m->idx, m->ufd, fd, b, &why);
+        return reply(d, rc, rc == 0 ? "" : why);
+}
+
+/*
+ * Stores a batch of descriptors with their registrations as the payloads. All
+ * are processed, the first failure is reported.
+ */
+static int vec(struct escrowd *d, const struct mvec *m, int32_t nr, int *fd) {
+        const char *why = "";
+        int         rc  = 0;
+        ASSERT(m->opcode == VEC);
+        if (UNLIKELY(!m_is_valid(d, m->tag, m->idx, 0) || m->nr != nr || m->idx + nr > MAX_IDX)) {
+                for (int32_t i = 0; i < nr; ++i) {
+                        close(fd[i]);
+                }
+                return reply(d, -EINVAL, "Wrong VEC request.");
+        }
+        for (int32_t i = 0; i < nr; ++i) {
+                const char *w;
+                int         r = store(d, m->tag, m->idx + i, m->reg[i].fd, fd[i],
+                                      (void *)&m->reg[i], sizeof m->reg[i], &w);
+                if (rc == 0 && r != 0) {
+                        rc  = r;
+                        why = w;
+                }
+        }
+        return reply(d, rc, why);
+}
+
+/* Stores the records of an emergency dump batch. */
+static int dmp(struct escrowd *d, const struct mdmp *m, int32_t nr, int *fd) {
+        const char  *why = "";
+        int          rc  = 0;
+        int32_t      off = 0;
+        int32_t      k   = 0;
+        struct mdrec rec;
+        ASSERT(m->opcode == DMP);
+        if (UNLIKELY(m->nr < 0 || m->nob < 0 || m->nob > MAX_PAYLOAD)) {
+                rc  = -EINVAL;
+                why = "Wrong DMP request.";
+        }
+        for (int32_t i = 0; rc == 0 && i < m->nr; ++i) {
+                const char *w;
+                int         r;
+                if (off + SOF(rec) > m->nob) {
+                        rc  = -EINVAL;
+                        why = "Truncated DMP request.";
+                        break;
+                }
+                memcpy(&rec, m->data + off, sizeof rec);
+                off += sizeof rec;
+                if (UNLIKELY(rec.nob < 0 || off + rec.nob > m->nob || (rec.ufd >= 0 && k == nr))) {
+                        rc  = -EINVAL;
+                        why = "Truncated DMP request.";
+                        break;
+                }
+                if (LIKELY(m_is_valid(d, rec.tag, rec.idx, 0))) {
+                        r = store(d, rec.tag, rec.idx, rec.ufd, rec.ufd >= 0 ? fd[k++] : -1,
+                                  m->data + off, rec.nob, &w);
+                } else { /* Skip it, the rest of the dump is still of use. */
+                        r = -EINVAL;
+                        w = "Wrong DMP record.";
+                        if (rec.ufd >= 0) {
+                                close(fd[k++]);
+                        }
+                }
+                off += rec.nob;
+                if (r != 0 && d->quiet) {
+                        defer(d, rec.tag, rec.idx, r);
+                } else if (r != 0 && rc == 0) {
+                        rc  = r;
+                        why = w;
+                }
+        }
+        while (k < nr) { /* Not taken by the records. */
+                close(fd[k++]);
+        }
+        mirror_bump(d);
+        if (rc != 0 && d->quiet) {
+                defer(d, -1, -1, rc);
+        }
+        return d->quiet ? 0 : reply(d, rc, why);
+}
+
+static int del(struct escrowd *d, const struct mdel *m, int fd) {
+        struct slot *s;
+        ASSERT(m->opcode == DEL);
+        if (UNLIKELY(!m_is_valid(d, m->tag, m->idx, 0))) {
+                return reply(d, -EINVAL, "Wrong DEL request.");
+        }
+        if (fd != -1) {
+                return reply(d, -EINVAL, "Descriptor present in a DEL request.");
+        }
+        s = seq_get(&d->tags[m->tag].seq, m->idx);
+        if (UNLIKELY(s == NULL)) {
+                return reply(d, -EINVAL, "Non-existent index in DEL request.");
+        }
+        slot_del(d, s);
+        return ok(d);
+}
+
+static void slot_drop(void *arg, void *slot) {
+        struct slot *s = slot;
+        watch_mark(arg, s->tag, s->idx, true);
+        slot_use(arg, s, -1);
+        slot_fini(arg, s);
+}
+
+/*
+ * Deletes the slots in the ranges. Ranges are cut from the sequences a leaf at
+ * a time: absent leaves are skipped and leaves covered entirely are freed.
+ */
+static int clr(struct escrowd *d, const struct mclr *m, int fd) {
+        int16_t lo = m->tag == ESCROW_ALL ? 0 : m->tag;
+        int16_t hi = m->tag == ESCROW_ALL ? d->nr_tags : m->tag + 1;
+        ASSERT(m->opcode == CLR);
+        if (UNLIKELY((m->tag != ESCROW_ALL && !m_is_valid(d, m->tag, 0, 0)) ||
+                     m->nr < 0 || m->nr > CLR_MAX)) {
+                return reply(d, -EINVAL, "Wrong CLR request.");
+        }
+        if (fd != -1) {
+                return reply(d, -EINVAL, "Descriptor present in a CLR request.");
+        }
+        for (int32_t i = 0; i < m->nr; ++i) {
+                int32_t idx = max_32(m->range[i].idx, 0);
+                int32_t end = min_32(m->range[i].end, MAX_IDX);
+                for (int16_t t = lo; t < hi && idx < end; ++t) {
+                        seq_cut(&d->tags[t].seq, idx, end, &slot_drop, d);
+                }
+        }
+        mirror_bump(d); /* Cheaper than tracking the ranges in the client. */
+        return ok(d);
+}
+
+/* Sets, renews or cancels a lease on a slot, a tag or the escrow. */
+static int lse(struct escrowd *d, const struct mlse *m, int fd) {
+        struct lease **lease;
+        struct slot   *s = NULL;
+        int            result;
+        ASSERT(m->opcode == LSE);
+        if (UNLIKELY(m->ttl < 0 ||
+                     (m->idx == ESCROW_ALL ? m->tag != ESCROW_ALL && !m_is_valid(d, m->tag, 0, 0) :
+                                             !m_is_valid(d, m->tag, m->idx, 0)))) {
+                return reply(d, -EINVAL, "Wrong LSE request.");
+        }
+        if (fd != -1) {
+                return reply(d, -EINVAL, "Descriptor present in a LSE request.");
+        }
+        if (m->idx != ESCROW_ALL) {
+                s = seq_get(&d->tags[m->tag].seq, m->idx);
+                if (UNLIKELY(s == NULL)) {
+                        return reply(d, -EINVAL, "Non-existent index in LSE request.");
+                }
+                lease = &s->lease;
+        } else {
+                lease = m->tag == ESCROW_ALL ? &d->lease : &d->tags[m->tag].lease;
+        }
+        result = lease_set(d, lease, s, m->tag, m->ttl);
+        return result == 0 ? ok(d) : reply(d, result, "Cannot allocate a lease.");
+}
+
+static int tag(struct escrowd *d, const struct mtag *m, int fd) {
+        struct tag *t    = &d->tags[m->tag];
+        struct minf info = {};
+        ASSERT(m->opcode == TAG);
+        if (UNLIKELY(!m_is_valid(d, m->tag, 0, 0))) {
+                return reply(d, -EINVAL, "Wrong TAG request.");
+        }
+        if (fd != -1) {
+                return reply(d, -EINVAL, "Descriptor present in a TAG request.");
+        }
+        info.opcode = INF;
+        info.nr     = t->use.slots;
+        info.total  = t->use.nob;
+        return msend(&d->stream, (void *)&info, -1);
+}
+
+/* Output batch, the payloads are sent directly from the slots. */
+struct out {
+        int32_t      nr;
+        struct mslot hdr[BATCH];
+        struct io    io[BATCH];
+};
+
+static int out_flush(struct escrowd *d, struct out *o) {
+        int32_t nr = o->nr;
+        o->nr = 0;
+        mrun(&d->stream, nr, o->io);
+        for (int32_t i = 0; i < nr; ++i) {
+                if (o->io[i].result != 0) {
+                        return o->io[i].result;
+                }
+        }
+        return 0;
+}
+
+static int out_slot(struct escrowd *d, struct out *o, int16_t tag, int32_t idx, struct slot *s) {
+        reap_rearm(d, s); /* The receiver might drain the unread input. */
+        /* Each message of the batch gets its own decompression buffer. */
+        const uint8_t *data = s->blob != NULL ?
+                blob_data(s->blob, d->unz + o->nr * MAX_PAYLOAD) : NULL;
+        o->hdr[o->nr] = (struct mslot){ .opcode = s->owner != NULL ? ADD | REMOTE : ADD,
+                                        .tag = tag, .idx = idx, .ufd = s->ufd, .nob = s->nob,
+                                        .ready = s->ready, .pending = s->pending, .fid = s->fid };
+        io_send(&o->io[o->nr], &o->hdr[o->nr], sizeof o->hdr[0], data, s->nob,
+                s->owner != NULL ? s->owner->pidfd : s->fd);
+        return ++o->nr == ARRAY_SIZE(o->io) ? out_flush(d, o) : 0;
+}
+
+static int slot_send(struct escrowd *d, int16_t tag, int32_t idx, struct slot *s) {
+        struct out o = {};
+        return out_slot(d, &o, tag, idx, s) ?: out_flush(d, &o);
+}
+
+static void slot_ready(struct slot *s, short revents) {
+        int pending = 0;
+        s->ready = ((revents & POLLIN)             ? ESCROW_IN  : 0) |
+                   ((revents & POLLOUT)            ? ESCROW_OUT : 0) |
+                   ((revents & (POLLHUP | POLLERR)) ? ESCROW_HUP : 0);
+        if ((s->ready & ESCROW_IN) && ioctl(s->fd, FIONREAD, &pending) != 0) {
+                pending = 0; /* A listener or not a socket. */
+        }
+        s->pending = pending;
+}
+
+/* Gathers readiness of the slots in a priority class, POLL_CHUNK descriptors per poll(). */
+static void class_ready(struct escrowd *d, int32_t prio) {
+        struct pollfd pfd[POLL_CHUNK];
+        struct slot  *slot[POLL_CHUNK];
+        int32_t       nr = 0;
+        for (int32_t i = 0; i < d->nr_tags; ++i) {
+                struct seq *s = &d->tags[i].seq;
+                if (d->tags[i].prio != prio) {
+                        continue;
+                }
+                for (int32_t idx = seq_next(s, 0); idx >= 0; idx = seq_next(s, idx + 1)) {
+                        slot[nr] = seq_get(s, idx);
+                        slot[nr]->ready = slot[nr]->pending = 0;
+                        if (slot[nr]->fd >= 0 && !(slot[nr]->flags & SLOT_DEAD)) {
+                                pfd[nr] = (struct pollfd){ .fd     = slot[nr]->fd,
+                                                           .events = POLLIN | POLLOUT };
+                                if (++nr == ARRAY_SIZE(pfd)) {
+                                        poll(pfd, nr, 0);
+                                        while (nr > 0) {
+                                                --nr;
+                                                slot_ready(slot[nr], pfd[nr].revents);
+                                        }
+                                }
+                        }
+                }
+        }
+        poll(pfd, nr, 0);
+        while (nr > 0) {
+                --nr;
+                slot_ready(slot[nr], pfd[nr].revents);
+        }
+}
+
+/* Fetches the descriptor of a remote slot from its owner, the slot becomes an ordinary one. */
+static int slot_pull(struct escrowd *d, struct slot *s, const char **why) {
+        int fd;
+        *why = over_quota(d, s->tag, s->idx, 0, s->nob);
+        if (UNLIKELY(*why != NULL)) {
+                return -EDQUOT;
+        }
+        fd = pid_getfd(s->owner->pidfd, s->ufd);
+        if (fd < 0) {
+                *why = "Cannot fetch the descriptor from its owner.";
+                return fd;
+        }
+        if (file_id(fd) != s->fid) {
+                close(fd);
+                *why = "The owner reused the descriptor number.";
+                return -ESTALE;
+        }
+        slot_use(d, s, -1);
+        owner_put(s->owner);
+        s->owner = NULL;
+        s->fd    = fd;
+        slot_use(d, s, +1);
+        reap_add(d, s);
+        return 0;
+}
+
+static int get(struct escrowd *d, const struct mget *m, int fd) {
+        struct slot *s;
+        const char  *why;
+        int          rc;
+        ASSERT(m->opcode == GET);
+        if (UNLIKELY(!m_is_valid(d, m->tag, m->idx, 0))) {
+                return reply(d, -EINVAL, "Wrong DEL request.");
+        }
+        if (fd != -1) {
+                return reply(d, -EINVAL, "Descriptor present in a GET request.");
+        }
+        s = seq_get(&d->tags[m->tag].seq, m->idx);
+        if (UNLIKELY(s == NULL)) {
+                return reply(d, -ENOENT, "Non-existent index in a GET request.");
+        }
+        if ((m->flags & GET_PULL) && s->owner != NULL && (rc = slot_pull(d, s, &why)) != 0) {
+                return reply(d, rc, why);
+        }
+        s->ready = s->pending = 0;
+        if ((m->flags & GET_READY) && s->fd >= 0) {
+                struct pollfd pfd = { .fd = s->fd, .events = POLLIN | POLLOUT };
+                poll(&pfd, 1, 0);
+                slot_ready(s, pfd.revents);
+        }
+        return slot_send(d, m->tag, m->idx, s);
+}
+
+/* Makes sure escrowd can hold FDS stored descriptors, raising RLIMIT_NOFILE if necessary. */
+static int fd_budget(int32_t fds) {
+        struct rlimit lim;
+        rlim_t        need = (rlim_t)fds + FD_SLACK;
+        if (getrlimit(RLIMIT_NOFILE, &lim) != 0) {
+                return -errno;
+        }
+        if (fds == 0 || lim.rlim_cur >= need) {
+                return 0;
+        }
+        lim.rlim_cur = need;
+        if (lim.rlim_max < need) {
+                lim.rlim_max = need; /* Needs CAP_SYS_RESOURCE. */
+        }
+        return setrlimit(RLIMIT_NOFILE, &lim) == 0 ? 0 : -errno;
+}
+
+static int set_quota(struct escrowd *d, const struct mset *m) {
+        struct escrow_quota *max = m->tag == ESCROW_ALL ? &d->max : &d->tags[m->tag].max;
+        int                  result;
+        if (m->val < 0) {
+                return reply(d, -ERANGE, "Negative quota.");
+        }
+        switch (m->attr) {
+        case ESCROW_MAX_SLOTS:
+                max->slots = m->val;
+                break;
+        case ESCROW_MAX_FDS:
+                if (m->tag == ESCROW_ALL) {
+                        result = fd_budget(m->val);
+                        if (result != 0) {
+                                return reply(d, result, "Cannot raise RLIMIT_NOFILE.");
+                        }
+                }
+                max->fds = m->val;
+                break;
+        case ESCROW_MAX_KB:
+                max->nob = (int64_t)m->val << 10;
+                break;
+        }
+        return ok(d);
+}
+
+static int set(struct escrowd *d, const struct mset *m, int fd) {
+        bool limit = m->attr == ESCROW_MAX_SLOTS || m->attr == ESCROW_MAX_FDS ||
+                     m->attr == ESCROW_MAX_KB;
+        ASSERT(m->opcode == SET);
+        if (UNLIKELY(!m_is_valid(d, m->tag, 0, 0) && !(limit && m->tag == ESCROW_ALL))) {
+                return reply(d, -EINVAL, "Wrong SET request.");
+        }
+        if (fd != -1) {
+                return reply(d, -EINVAL, "Descriptor present in a SET request.");
+        }
+        if (limit) {
+                return set_quota(d, m);
+        }
+        switch (m->attr) {
+        case ESCROW_PRIO:
+                if (m->val < INT16_MIN || m->val > INT16_MAX) {
+                        return reply(d, -ERANGE, "Priority out of range.");
+                }
+                d->tags[m->tag].prio = m->val;
+                break;
+        case ESCROW_ZIP:
+                if (m->val < 0) {
+                        return reply(d, -ERANGE, "Negative compression threshold.");
+                }
+                if (m->val > 0 && d->zbuf == NULL) {
+                        d->zbuf = mem_alloc(MAX_PAYLOAD);
+                        d->unz  = mem_alloc(BATCH * MAX_PAYLOAD);
+                        if (d->zbuf == NULL || d->unz == NULL) {
+                                mem_free(d->zbuf);
+                                mem_free(d->unz);
+                                d->zbuf = d->unz = NULL;
+                                return reply(d, -ENOMEM, "Cannot allocate compression buffers.");
+                        }
+                }
+                d->tags[m->tag].zip = m->val;
+                break;
+        case ESCROW_TTL:
+                if (m->val < 0) {
+                        return reply(d, -ERANGE, "Negative lease.");
+                }
+                d->tags[m->tag].ttl = m->val;
+                if (d->mirror != NULL) {
+                        __atomic_store_n(&d->mirror->ttl[m->tag], m->val, __ATOMIC_RELAXED);
+                }
+                break;
+        default:
+                return reply(d, -EINVAL, "Unknown attribute in a SET request.");
+        }
+        return ok(d);
+}
+
+/* Streams live slots of the class with (or without) pending input. */
+static int rec_pass(struct escrowd *d, struct out *o, int32_t prio, bool pending, int32_t *nr) {
+        for (int32_t i = 0; i < d->nr_tags; ++i) {
+                struct seq *s = &d->tags[i].seq;
+                if (d->tags[i].prio != prio) {
+                        continue;
+                }
+                for (int32_t idx = seq_next(s, 0); idx >= 0; idx = seq_next(s, idx + 1)) {
+                        struct slot *slot = seq_get(s, idx);
+                        int          result;
+                        if ((slot->flags & SLOT_DEAD) || pending != (slot->pending > 0)) {
+                                continue;
+                        }
+                        result = out_slot(d, o, i, idx, slot);
+                        if (result != 0) {
+                                return result;
+                        }
+                        ++*nr;
+                }
+        }
+        return 0;
+}
+
+/*
+ * REC_PULL: fetches the descriptors of the remote slots of the class, the
+ * failed ones stay remote.
+ */
+static void class_pull(struct escrowd *d, int32_t prio) {
+        for (int32_t i = 0; i < d->nr_tags; ++i) {
+                struct seq *s = &d->tags[i].seq;
+                if (d->tags[i].prio != prio) {
+                        continue;
+                }
+                for (int32_t idx = seq_next(s, 0); idx >= 0; idx = seq_next(s, idx + 1)) {
+                        struct slot *slot = seq_get(s, idx);
+                        const char  *why;
+                        if (slot->owner != NULL && slot_pull(d, slot, &why) != 0) {
+                                EV(d->stream.flags, OUT("Cannot pull %i %i: %s\n", i, idx, why));
+                        }
+                }
+        }
+}
+
+/*
+ * Streams all slots in the lowest priority class not below the requested one,
+ * terminated by an END message. Slots marked dead are skipped. Slots with
+ * pending input go first, so that the recovering process can serve them first.
+ */
+static int rec(struct escrowd *d, const struct mrec *m, int fd) {
+        int32_t     prio = INT32_MAX;
+        struct mend end  = { .opcode = END };
+        struct out  o    = {};
+        ASSERT(m->opcode == REC);
+        if (fd != -1) {
+                return reply(d, -EINVAL, "Descriptor present in a REC request.");
+        }
+        for (int32_t i = 0; i < d->nr_tags; ++i) {
+                struct tag *t = &d->tags[i];
+                if (t->use.slots > 0 && t->prio >= m->prio && t->prio < prio) {
+                        prio = t->prio;
+                }
+        }
+        if (prio == INT32_MAX) {
+                return reply(d, -ENOENT, "No more priority classes.");
+        }
+        if (m->flags & REC_PULL) {
+                class_pull(d, prio);
+        }
+        class_ready(d, prio);
+        end.prio = prio;
+        return rec_pass(d, &o, prio, true, &end.nr) ?: rec_pass(d, &o, prio, false, &end.nr) ?:
+                out_flush(d, &o) ?: msend(&d->stream, (void *)&end, -1);
+}
+
+/* Appends the run to the RUN message, sending the message first if the run would not fit. */
+static int man_run(struct escrowd *d, struct mman *out, const struct mrun *run,
+                   const uint16_t *nob) {
+        int32_t size = sizeof *run + run->nr * sizeof nob[0];
+        int     result;
+        if (out->nob + size > MAX_PAYLOAD) {
+                result = msend(&d->stream, (void *)out, -1);
+                out->nob = 0;
+                if (result != 0) {
+                        return result;
+                }
+        }
+        memcpy(out->data + out->nob, run, sizeof *run);
+        memcpy(out->data + out->nob + sizeof *run, nob, run->nr * sizeof nob[0]);
+        out->nob += size;
+        return 0;
+}
+
+/*
+ * Streams the manifest: the runs of present indices with the same descriptor
+ * presence and their payload sizes, packed in RUN messages, terminated by END.
+ */
+static int manifest(struct escrowd *d, const struct mman *m, int fd) {
+        enum { RUN_MAX = (MAX_PAYLOAD - sizeof(struct mrun)) / sizeof(uint16_t) };
+        struct mman *out;
+        uint16_t    *nob;
+        struct mend  end    = { .opcode = END };
+        struct mrun  run    = {};
+        int          result = 0;
+        ASSERT(m->opcode == MAN);
+        if (fd != -1) {
+                return reply(d, -EINVAL, "Descriptor present in a MAN request.");
+        }
+        out = mem_alloc(sizeof *out + RUN_MAX * sizeof nob[0]);
+        if (out == NULL) {
+                return reply(d, -ENOMEM, "Cannot allocate a manifest.");
+        }
+        nob = (void *)(out + 1);
+        out->opcode = RUN;
+        for (int32_t i = 0; i < d->nr_tags && result == 0; ++i) {
+                struct seq *s = &d->tags[i].seq;
+                for (int32_t idx = seq_next(s, 0); idx >= 0 && result == 0;
+                     idx = seq_next(s, idx + 1)) {
+                        struct slot *slot  = seq_get(s, idx);
+                        uint16_t     flags = slot->fd >= 0 || slot->owner != NULL ?
+                                             ESCROW_RUN_FD : 0;
+                        if (run.nr > 0 && (run.tag != i || run.idx + run.nr != idx ||
+                                           run.flags != flags || run.nr == RUN_MAX)) {
+                                result = man_run(d, out, &run, nob);
+                                run.nr = 0;
+                        }
+                        if (run.nr == 0) {
+                                run = (struct mrun){ .tag = i, .flags = flags, .idx = idx };
+                        }
+                        nob[run.nr++] = slot->nob;
+                        ++end.nr;
+                }
+        }
+        if (result == 0 && run.nr > 0) {
+                result = man_run(d, out, &run, nob);
+        }
+        if (result == 0 && out->nob > 0) {
+                result = msend(&d->stream, (void *)out, -1);
+        }
+        mem_free(out);
+        return result ?: msend(&d->stream, (void *)&end, -1);
+}
+
+/* Replies with the failures deferred since the last SYN and forgets them. */
+static int syn(struct escrowd *d, const struct merr *m, int fd) {
+        struct merr err = { .opcode = ERR, .nr = d->nr_err };
+        ASSERT(m->opcode == SYN);
+        if (fd != -1) {
+                return reply(d, -EINVAL, "Descriptor present in a SYN request.");
+        }
+        memcpy(err.err, d->err, min_32(d->nr_err, ERRORS) * sizeof d->err[0]);
+        d->nr_err = 0;
+        return msend(&d->stream, (void *)&err, -1);
+}
+
+/*
+ * Streams the live descriptors of the tag with their registrations in VEC
+ * messages, terminated by END.
+ */
+static int vgt(struct escrowd *d, const struct mtag *m, int fd) {
+        struct mvec  out    = { .opcode = VEC, .tag = m->tag };
+        struct mend  end    = { .opcode = END };
+        int          fds[VEC_MAX];
+        struct seq  *s;
+        int          result = 0;
+        ASSERT(m->opcode == VGT);
+        if (UNLIKELY(!m_is_valid(d, m->tag, 0, 0))) {
+                return reply(d, -EINVAL, "Wrong VGT request.");
+        }
+        if (fd != -1) {
+                return reply(d, -EINVAL, "Descriptor present in a VGT request.");
+        }
+        s = &d->tags[m->tag].seq;
+        for (int32_t idx = seq_next(s, 0); idx >= 0 && result == 0; idx = seq_next(s, idx + 1)) {
+                struct slot       *slot = seq_get(s, idx);
+                struct escrow_reg *reg  = &out.reg[out.nr];
+                if (slot->fd < 0 || (slot->flags & SLOT_DEAD)) {
+                        continue;
+                }
+                SET0(reg);
+                if (slot->blob != NULL) {
+                        memcpy(reg, blob_data(slot->blob, d->unz), min_32(slot->nob, sizeof *reg));
+                }
+                reg->fd = slot->ufd;
+                fds[out.nr] = slot->fd;
+                if (out.nr++ == 0) {
+                        out.idx = idx;
+                }
+                ++end.nr;
+                if (out.nr == VEC_MAX) {
+                        result = msendv(&d->stream, (void *)&out, out.nr, fds);
+                        out.nr = 0;
+                }
+        }
+        if (result == 0 && out.nr > 0) {
+                result = msendv(&d->stream, (void *)&out, out.nr, fds);
+        }
+        return result ?: msend(&d->stream, (void *)&end, -1);
+}
+
+/* The session was handed over to the sender in escrowd_wait(), if there was one. */
+static int tko(struct escrowd *d, const struct mtag *m, int fd) {
+        ASSERT(m->opcode == TKO);
+        if (fd != -1) {
+                return reply(d, -EINVAL, "Descriptor present in a TKO request.");
+        }
+        return ok(d);
+}
+
+/* Passes the mirror to a client, on the session or on a lobby connection. */
+static int hel(struct escrowd *d, const struct stream *s, const struct mhel *m, int fd) {
+        struct mhel rep = { .opcode = HEL, .nr_tags = d->nr_tags };
+        ASSERT(m->opcode == HEL);
+        if (fd != -1) {
+                return reply_on(d, s->fd, -EINVAL, "Descriptor present in a HEL request.");
+        }
+        if (d->mirror == NULL) {
+                return reply_on(d, s->fd, -EOPNOTSUPP, "No mirror.");
+        }
+        return msend(s, (void *)&rep, d->mirror_fd);
+}
+
+static int sta(struct escrowd *d, const struct msta *m, int fd) {
+        struct msta sts = { .opcode = STS, .stats = d->st };
+        ASSERT(m->opcode == STA);
+        if (fd != -1) {
+                return reply(d, -EINVAL, "Descriptor present in a STA request.");
+        }
+        return msend(&d->stream, (void *)&sts, -1);
+}
+
+/* @reap */
+
+/*
+ * With ESCROW_REAP or ESCROW_MARK, escrowd watches the stored descriptors for
+ * hang-ups (without reading from them) while waiting for the next request or
+ * connection, and drops or marks the slots whose peers are gone. Linux only.
+ *
+ * Descriptors are watched one-shot: a half-closed socket with unread input is
+ * kept, and is only watched again once it has been handed out, as nobody else
+ * can drain it.
+ */
+
+#if defined(__linux__)
+
+#define REAP_EVENTS (EPOLLRDHUP | EPOLLONESHOT)
+
+static void reap_add(struct escrowd *d, struct slot *s) {
+        struct epoll_event ev = { .events = REAP_EVENTS, .data.ptr = s };
+        if (d->ep >= 0) { /* Fails harmlessly for descriptors that cannot be polled. */
+                epoll_ctl(d->ep, EPOLL_CTL_ADD, s->fd, &ev);
+        }
+}
+
+static void reap_rearm(struct escrowd *d, struct slot *s) {
+        struct epoll_event ev = { .events = REAP_EVENTS, .data.ptr = s };
+        if (s->flags & SLOT_KEPT) {
+                s->flags &= ~SLOT_KEPT;
+                epoll_ctl(d->ep, EPOLL_CTL_MOD, s->fd, &ev);
+        }
+}
+
+static void reap_del(struct escrowd *d, struct slot *s) {
+        /* Needed, as the user might still have the file open. */
+        if (d->ep >= 0 && !(s->flags & SLOT_DEAD)) {
+                epoll_ctl(d->ep, EPOLL_CTL_DEL, s->fd, NULL);
+        }
+}
+
+static void reap(struct escrowd *d, struct slot *s, uint32_t events) {
+        int pending = 0;
+        if (!(events & (EPOLLHUP | EPOLLERR)) &&
+            ioctl(s->fd, FIONREAD, &pending) == 0 && pending > 0) {
+                s->flags |= SLOT_KEPT; /* Half-closed with unread input: still of use. */
+                return;
+        }
+        EV(d->stream.flags, OUT("Dead descriptor: %i %i (%x).\n", s->tag, s->idx, events));
+        if (d->stream.flags & ESCROW_REAP) {
+                ++d->st.nr_reaped;
+                slot_del(d, s);
+                mirror_bump(d);
+        } else {
+                epoll_ctl(d->ep, EPOLL_CTL_DEL, s->fd, NULL);
+                s->flags |= SLOT_DEAD;
+                ++d->st.nr_dead;
+        }
+}
+
+/*
+ * Reaps up to BATCH descriptors whose hang-ups are pending, without blocking.
+ * The rest are left to the next wakeup, so that requests are not starved.
+ */
+static int reap_pending(struct escrowd *d) {
+        struct epoll_event ev[BATCH];
+        int                nr = epoll_wait(d->ep, ev, ARRAY_SIZE(ev), 0);
+        if (nr < 0) {
+                return errno == EINTR ? 0 : -errno;
+        }
+        for (int i = 0; i < nr; ++i) {
+                reap(d, ev[i].data.ptr, ev[i].events);
+        }
+        return 0;
+}
+
+static int reap_init(struct escrowd *d) {
+        d->ep = -1;
+        if (d->stream.flags & (ESCROW_REAP | ESCROW_MARK)) {
+                d->ep = epoll_create1(EPOLL_CLOEXEC);
+                if (d->ep < 0) {
+                        return -errno;
+                }
+        }
+        return 0;
+}
+
+#else
+
+static void reap_add(struct escrowd *d, struct slot *s) {
+}
+
+static void reap_del(struct escrowd *d, struct slot *s) {
+}
+
+static void reap_rearm(struct escrowd *d, struct slot *s) {
+}
+
+static int reap_pending(struct escrowd *d) {
+        return 0;
+}
+
+static int reap_init(struct escrowd *d) {
+        d->ep = -1;
+        return 0;
+}
+
+#endif
+
+/* @lease */
+
+/*
+ * Leases are kept in a hierarchical timer wheel: WHEEL_LEVELS levels of
+ * 1 << WHEEL_SHIFT buckets, a bucket at level L spanning the ticks with the
+ * same bits above L * WHEEL_SHIFT. Setting, renewing and cancelling a lease is
+ * O(1). A tick processes one level 0 bucket, and, when the tick is a multiple
+ * of a level span, re-distributes the next bucket of that level to the lower
+ * levels, so a lease moves at most WHEEL_LEVELS times before it expires. With
+ * 10 ms ticks the wheel spans 2^30 ticks (124 days), more than any TTL.
+ */
+
+static uint64_t lease_tick(void) {
+        return op_now() / (WHEEL_TICK * 1000000ull);
+}
+
+/* The tick T in the units of the LEVEL. */
+static uint64_t wheel_at(uint64_t t, int32_t level) {
+        return t >> (WHEEL_SHIFT * level);
+}
+
+static void lease_link(struct wheel *w, struct lease *l) {
+        uint64_t       at    = l->expire > w->now ? l->expire : w->now + 1;
+        int32_t        level = 0;
+        struct lease **head;
+        while (level < WHEEL_LEVELS - 1 && wheel_at(at, level + 1) != wheel_at(w->now, level + 1)) {
+                ++level;
+        }
+        head = &w->bucket[level][wheel_at(at, level) & MASK(WHEEL_SHIFT)];
+        l->next = *head;
+        l->prev = head;
+        if (*head != NULL) {
+                (*head)->prev = &l->next;
+        }
+        *head = l;
+}
+
+static void lease_unlink(struct lease *l) {
+        *l->prev = l->next;
+        if (l->next != NULL) {
+                l->next->prev = l->prev;
+        }
+}
+
+static int lease_set(struct escrowd *d, struct lease **lease, struct slot *slot, int16_t tag,
+                     int32_t ttl) {
+        struct lease *l = *lease;
+        if (ttl == 0) {
+                lease_del(d, l);
+                *lease = NULL;
+                return 0;
+        }
+        if (l == NULL) {
+                l = mem_alloc(sizeof *l);
+                if (UNLIKELY(l == NULL)) {
+                        return ERROR(-ENOMEM);
+                }
+                l->slot = slot;
+                l->tag  = tag;
+                *lease  = l;
+                if (d->st.nr_leases++ == 0) { /* The wheel stands still without leases. */
+                        d->wheel.now = lease_tick();
+                }
+        } else {
+                lease_unlink(l);
+        }
+        l->expire = lease_tick() + (ttl + WHEEL_TICK - 1) / WHEEL_TICK;
+        lease_link(&d->wheel, l);
+        return 0;
+}
+
+static void lease_del(struct escrowd *d, struct lease *l) {
+        if (l != NULL) {
+                lease_unlink(l);
+                --d->st.nr_leases;
+                mem_free(l);
+        }
+}
+
+static void lease_expire(struct escrowd *d, struct lease *l) {
+        int32_t slots = d->st.use.slots;
+        EV(d->stream.flags, OUT("Lease expired: %i %i.\n",
+                                l->tag, l->slot != NULL ? l->slot->idx : ESCROW_ALL));
+        --d->st.nr_leases;
+        if (l->slot != NULL) {
+                l->slot->lease = NULL;
+                slot_del(d, l->slot);
+        } else {
+                int16_t lo = l->tag == ESCROW_ALL ? 0 : l->tag;
+                int16_t hi = l->tag == ESCROW_ALL ? d->nr_tags : l->tag + 1;
+                *(l->tag == ESCROW_ALL ? &d->lease : &d->tags[l->tag].lease) = NULL;
+                for (int16_t t = lo; t < hi; ++t) {
+                        seq_cut(&d->tags[t].seq, 0, MAX_IDX, &slot_drop, d);
+                }
+        }
+        d->st.nr_expired += slots - d->st.use.slots;
+        mem_free(l);
+        mirror_bump(d);
+}
+
+/* Processes the bucket: expires the due leases, moves the others down. */
+static void lease_bucket(struct escrowd *d, struct lease **bucket) {
+        struct lease *todo = *bucket;
+        struct lease *l;
+        *bucket = NULL;
+        /* Expiring a tag deletes the leases of its slots, possibly from this list. */
+        if (todo != NULL) {
+                todo->prev = &todo;
+        }
+        while ((l = todo) != NULL) {
+                lease_unlink(l);
+                if (l->expire <= d->wheel.now) {
+                        lease_expire(d, l);
+                } else {
+                        lease_link(&d->wheel, l);
+                }
+        }
+}
+
+/*
+ * Turns the wheel to the current tick. Returns the poll() timeout till the next
+ * tick with something to do.
+ */
+static int lease_run(struct escrowd *d) {
+        struct wheel *w   = &d->wheel;
+        uint64_t      now = lease_tick();
+        uint64_t      next;
+        int64_t       ns;
+        while (d->st.nr_leases > 0 && w->now < now) {
+                ++w->now;
+                /* Higher levels first: they feed the lower. */
+                for (int32_t level = WHEEL_LEVELS - 1; level >= 0; --level) {
+                        uint64_t slot = wheel_at(w->now, level) & MASK(WHEEL_SHIFT);
+                        if ((w->now & MASK(WHEEL_SHIFT * level)) == 0) {
+                                lease_bucket(d, &w->bucket[level][slot]);
+                        }
+                }
+        }
+        if (d->st.nr_leases == 0) {
+                return -1;
+        }
+        for (next = w->now + 1;
+             (next & MASK(WHEEL_SHIFT)) != 0 && w->bucket[0][next & MASK(WHEEL_SHIFT)] == NULL;
+             ++next) {
+                ;
+        }
+        ns = next * WHEEL_TICK * 1000000ull - op_now();
+        return ns > 0 ? ns / 1000000 + 1 : 0;
+}
+
+/* @mirror */
+
+/*
+ * Escrowd shares a page with the clients, which map it read-only. A client
+ * with ESCROW_SHADOW keeps its own index of the slots (struct shadow) and
+ * maintains it as its requests change them. The page tells it when that is not
+ * enough: mirror::gen is bumped whenever the slots change otherwise (a lease
+ * expires, a dead socket is reaped, a QUIET request fails, the session is
+ * taken over) or in bulk (CLR and DMP). The page also has the lease TTL of each
+ * tag, as an escrow_add() in a tag with a TTL renews the lease.
+ */
+
+#if defined(HAS_MIRROR)
+
+static int mirror_init(struct escrowd *d) {
+        int32_t nob = offsetof(struct mirror, ttl) + d->nr_tags * sizeof d->mirror->ttl[0];
+        void   *map;
+        d->mirror_fd = memfd_create("escrow-mirror", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+        if (d->mirror_fd < 0) {
+                return -errno;
+        }
+        if (ftruncate(d->mirror_fd, nob) != 0 ||
+            (map = mmap(NULL, nob, PROT_READ | PROT_WRITE, MAP_SHARED,
+                        d->mirror_fd, 0)) == MAP_FAILED) {
+                int result = -errno;
+                close(d->mirror_fd);
+                d->mirror_fd = -1;
+                return result;
+        }
+        d->mirror          = map;
+        d->mirror_nob      = nob;
+        d->mirror->nr_tags = d->nr_tags;
+        /*
+         * A client truncating the file would kill escrowd with SIGBUS. Best effort: Linux
+         * 3.17, 5.1 for FUTURE_WRITE.
+         */
+        fcntl(d->mirror_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW);
+#if defined(F_SEAL_FUTURE_WRITE)
+        fcntl(d->mirror_fd, F_ADD_SEALS, F_SEAL_FUTURE_WRITE);
+#endif
+        return 0;
+}
+
+static void mirror_fini(struct escrowd *d) {
+        if (d->mirror != NULL) {
+                munmap(d->mirror, d->mirror_nob);
+                close(d->mirror_fd);
+        }
+}
+
+#else
+
+static int mirror_init(struct escrowd *d) {
+        d->mirror_fd = -1;
+        return -EOPNOTSUPP;
+}
+
+static void mirror_fini(struct escrowd *d) {
+}
+
+#endif
+
+/* @daemon */
+
+static void lobby_del(struct escrowd *d, int32_t i) {
+        --d->nr_lobby;
+        memmove(&d->lobby[i],  &d->lobby[i + 1],  (d->nr_lobby - i) * sizeof d->lobby[0]);
+        memmove(&d->parked[i], &d->parked[i + 1], (d->nr_lobby - i) * sizeof d->parked[0]);
+}
+
+/*
+ * Hands the session over to the I-th lobby connection. The superseded session
+ * is fenced: escrowd keeps reading it, but fails all its requests with -ESTALE,
+ * so that the old process can linger without modifying the escrow. The old
+ * process is told right away with an FNC message, so that it learns even if it
+ * sends nothing more (see escrow_fenced()).
+ */
+static void takeover(struct escrowd *d, int32_t i) {
+        struct mtag fnc = { .opcode = FNC };
+        int         fd  = d->lobby[i];
+        lobby_del(d, i);
+        if (d->fenced >= 0) {
+                close(d->fenced);
+        }
+        d->fenced = d->stream.fd;
+        /* Escrowd must not block on a process that does not read its replies. */
+        fcntl(d->fenced, F_SETFL, fcntl(d->fenced, F_GETFL) | O_NONBLOCK);
+        msend(&(struct stream){ .flags = d->stream.flags, .fd = d->fenced }, (void *)&fnc, -1);
+        owner_put(d->owner); /* The remote slots keep it. */
+        d->owner = NULL;
+        d->stream.fd = fd;
+        d->nr_err = 0;
+        mirror_bump(d);
+        EV(d->stream.flags, OUT("Session taken over.\n"));
+}
+
+/*
+ * Watchers. Changes are tracked by state, not logged: a change marks the slot
+ * dirty for each watcher, remembering whether the slot was present before the
+ * first change. A report compares this with the current state of the slot, so
+ * a burst of changes to a slot costs a single event, and nothing is queued for
+ * a watcher that does not keep up.
+ */
+
+static void watch_dirty(struct watcher *w, int16_t tag, int32_t idx, bool existed) {
+        struct seq *dirty = &w->dirty[w->tag == ESCROW_ALL ? tag : 0];
+        if (w->marks++ == 0) {
+                w->since = op_now();
+        }
+        if (seq_get(dirty, idx) == NULL) { /* Otherwise the first change is remembered already. */
+                uintptr_t state = existed ? DIRTY_OLD : DIRTY_NEW;
+                if (LIKELY(seq_add(dirty, idx, (void *)state) == 0)) {
+                        ++w->nr_dirty;
+                } else {
+                        w->broken = true;
+                }
+        }
+}
+
+static void watch_mark(struct escrowd *d, int16_t tag, int32_t idx, bool existed) {
+        for (int32_t j = 0; j < d->nr_watch; ++j) {
+                if (d->watch[j].tag == ESCROW_ALL || d->watch[j].tag == tag) {
+                        watch_dirty(&d->watch[j], tag, idx, existed);
+                }
+        }
+}
+
+static void dirty_drop(void *arg, void *val) {
+        (void)val;
+        --((struct watcher *)arg)->nr_dirty;
+}
+
+/* Sends the batch and forgets the dirty marks it covers: from (TAG, IDX) to (END_TAG, END). */
+static int watch_send(struct escrowd *d, struct watcher *w, int16_t tag, int32_t idx,
+                      int16_t end_tag, int32_t end) {
+        struct stream s = { .flags = d->stream.flags, .fd = w->fd };
+        int16_t       lo = w->tag == ESCROW_ALL ? 0 : w->tag;
+        int           result;
+        if (d->evt->nob == 0) {
+                return 0;
+        }
+        result = msend(&s, (void *)d->evt, -1);
+        if (result == 0) {
+                for (int16_t t = tag; t <= end_tag; ++t) {
+                        seq_cut(&w->dirty[t - lo], t == tag ? idx : 0, t == end_tag ? end : MAX_IDX,
+                                &dirty_drop, w);
+                }
+                d->evt->nob = 0;
+        }
+        return result;
+}
+
+/* Reports the dirty slots to the watcher, then ESCROW_EV_SYNCED after the first report. */
+static int watch_flush(struct escrowd *d, struct watcher *w) {
+        struct mevt *evt = d->evt;
+        int16_t      lo  = w->tag == ESCROW_ALL ? 0 : w->tag;
+        int16_t      hi  = w->tag == ESCROW_ALL ? d->nr_tags : w->tag + 1;
+        int16_t      tag = lo; /* The first slot in the batch. */
+        int32_t      idx = 0;
+        int          result = 0;
+        evt->opcode = EVT;
+        evt->nob    = 0;
+        for (int16_t t = lo; t < hi && result == 0; ++t) {
+                struct seq *dirty = &w->dirty[t - lo];
+                for (int32_t i = seq_next(dirty, 0); i >= 0; i = seq_next(dirty, i + 1)) {
+                        struct slot *slot    = seq_get(&d->tags[t].seq, i);
+                        bool         existed = seq_get(dirty, i) == (void *)(uintptr_t)DIRTY_OLD;
+                        int32_t      nob     = slot != NULL && (w->flags & ESCROW_WATCH_DATA) ?
+                                               slot->nob : 0;
+                        struct mev   ev      = { .tag = t, .idx = i };
+                        /* Added and deleted since the last report. */
+                        if (slot == NULL && !existed) {
+                                seq_del(dirty, i);
+                                --w->nr_dirty;
+                                continue;
+                        }
+                        if (evt->nob + SOF(ev) + nob > SOF(evt->data)) {
+                                result = watch_send(d, w, tag, idx, t, i);
+                                if (result != 0) {
+                                        break;
+                                }
+                                tag = t;
+                                idx = i;
+                        }
+                        ev.type  = slot == NULL ? ESCROW_EV_DEL :
+                                   existed ? ESCROW_EV_UPDATE : ESCROW_EV_ADD;
+                        ev.nob   = slot != NULL ? slot->nob : 0;
+                        ev.flags = slot != NULL && (slot->fd >= 0 || slot->owner != NULL) ?
+                                   ESCROW_RUN_FD : 0;
+                        memcpy(evt->data + evt->nob, &ev, sizeof ev);
+                        if (nob > 0 && slot->blob != NULL) {
+                                memcpy(evt->data + evt->nob + sizeof ev,
+                                       blob_data(slot->blob, d->unz), nob);
+                        }
+                        evt->nob += sizeof ev + nob;
+                }
+        }
+        if (result == 0) {
+                result = watch_send(d, w, tag, idx, hi - 1, MAX_IDX);
+        }
+        if (result == 0 && w->nr_dirty == 0) {
+                struct stream s   = { .flags = d->stream.flags, .fd = w->fd };
+                struct mend   end = { .opcode = END };
+                for (int16_t t = lo; t < hi; ++t) { /* Release the leaves. */
+                        seq_fini(&w->dirty[t - lo]);
+                        SET0(&w->dirty[t - lo]);
+                }
+                if (!w->synced) {
+                        result = msend(&s, (void *)&end, -1);
+                        w->synced = result == 0;
+                }
+        }
+        if (result == -EAGAIN) { /* The rest is reported once the watcher catches up. */
+                w->blocked = true;
+                result = 0;
+        } else {
+                w->marks = 0;
+        }
+        return result;
+}
+
+/* Subscribes the connection, which escrowd takes over, to the changes. */
+static int watch_add(struct escrowd *d, int fd, const struct mwch *m, const char **why) {
+        int16_t         lo = m->tag == ESCROW_ALL ? 0 : m->tag;
+        int16_t         hi = m->tag == ESCROW_ALL ? d->nr_tags : m->tag + 1;
+        struct watcher *w  = &d->watch[d->nr_watch];
+        if (UNLIKELY(m->tag != ESCROW_ALL && !m_is_valid(d, m->tag, 0, 0))) {
+                *why = "Wrong WCH request.";
+                return -EINVAL;
+        }
+        if (d->nr_watch == WATCHERS) {
+                *why = "Too many watchers.";
+                return -EBUSY;
+        }
+        if (d->evt == NULL) {
+                d->evt = mem_alloc(sizeof *d->evt);
+        }
+        *w = (struct watcher){ .fd    = fd,
+                               .tag   = m->tag,
+                               .flags = m->flags,
+                               .dirty = mem_alloc((hi - lo) * sizeof w->dirty[0]) };
+        if (d->evt == NULL || w->dirty == NULL) {
+                mem_free(w->dirty);
+                *why = "Cannot allocate watcher.";
+                return -ENOMEM;
+        }
+        ++d->nr_watch;
+        for (int16_t t = lo; t < hi; ++t) { /* The present slots are reported as added. */
+                struct seq *s = &d->tags[t].seq;
+                for (int32_t idx = seq_next(s, 0); idx >= 0; idx = seq_next(s, idx + 1)) {
+                        watch_dirty(w, t, idx, false);
+                }
+        }
+        /* Escrowd must not block on a watcher that does not keep up. */
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        EV(d->stream.flags, OUT("Watcher added: %i.\n", m->tag));
+        return 0;
+}
+
+static void watch_del(struct escrowd *d, int32_t j) {
+        struct watcher *w  = &d->watch[j];
+        int16_t         nr = w->tag == ESCROW_ALL ? d->nr_tags : 1;
+        close(w->fd);
+        for (int16_t t = 0; t < nr; ++t) {
+                seq_fini(&w->dirty[t]);
+        }
+        mem_free(w->dirty);
+        --d->nr_watch;
+        memmove(&d->watch[j], &d->watch[j + 1], (d->nr_watch - j) * sizeof d->watch[0]);
+        EV(d->stream.flags, OUT("Watcher deleted.\n"));
+}
+
+/*
+ * Reports to the watchers whose changes waited WATCH_DELAY, or piled up to
+ * WATCH_LAG. Returns the poll() timeout till the next report is due.
+ */
+static int watch_due(struct escrowd *d) {
+        uint64_t now     = d->nr_watch > 0 ? op_now() : 0;
+        int      timeout = -1;
+        /* Downwards: watch_del() shifts the tail. */
+        for (int32_t j = d->nr_watch - 1; j >= 0; --j) {
+                struct watcher *w  = &d->watch[j];
+                int64_t         ms = ((int64_t)(w->since - now) + 999999) / 1000000 + WATCH_DELAY;
+                if (w->broken) {
+                        watch_del(d, j);
+                } else if (w->blocked || (w->nr_dirty == 0 && w->synced)) {
+                        continue;
+                } else if (!w->synced || w->marks >= WATCH_LAG || ms <= 0) {
+                        if (watch_flush(d, w) != 0) {
+                                watch_del(d, j);
+                        }
+                } else if (timeout < 0 || ms < timeout) {
+                        timeout = ms;
+                }
+        }
+        return timeout;
+}
+
+/* A session asks to become a watcher (no other session was present), see lobby_watch(). */
+static int wch(struct escrowd *d, const struct mwch *m, int fd) {
+        const char *why;
+        int         result;
+        ASSERT(m->opcode == WCH);
+        if (fd != -1) {
+                return reply(d, -EINVAL, "Descriptor present in a WCH request.");
+        }
+        result = watch_add(d, d->stream.fd, m, &why);
+        if (result != 0) {
+                return reply(d, result, why) ?: result;
+        }
+        d->stream.fd = -1; /* The session is over. */
+        return 0;
+}
+
+/* Turns the I-th lobby connection into a watcher, without waiting for the session. */
+static void lobby_watch(struct escrowd *d, int32_t i) {
+        struct stream s  = { .flags = d->stream.flags, .fd = d->lobby[i] };
+        int           fd = -1;
+        const char   *why = "Wrong WCH request.";
+        int           result;
+        lobby_del(d, i);
+        result = mrecv(&s, d->req, &fd);
+        if (fd >= 0) {
+                close(fd);
+                result = -EINVAL;
+        }
+        if (result == 0) {
+                result = watch_add(d, s.fd, &d->req->wch, &why);
+        }
+        if (result != 0) {
+                reply_on(d, s.fd, result, why);
+                close(s.fd);
+        }
+}
+
+/* Answers a HEL on the I-th lobby connection, which then keeps waiting for its turn. */
+static void lobby_hello(struct escrowd *d, int32_t i) {
+        struct stream s  = { .flags = d->stream.flags, .fd = d->lobby[i] };
+        int           fd = -1;
+        int           result;
+        result = mrecv(&s, d->req, &fd);
+        if (result == 0) {
+                result = hel(d, &s, &d->req->hel, fd);
+        }
+        if (fd >= 0) {
+                close(fd);
+        }
+        if (result != 0) {
+                close(s.fd);
+                lobby_del(d, i);
+        }
+}
+
+/*
+ * Peeks at the first request on the I-th lobby connection. A takeover request
+ * gets the session, a watch request makes a watcher, a HEL is answered right
+ * away, the others wait for their turn, unwatched. Returns true if the session
+ * was handed over.
+ */
+static bool lobby_peek(struct escrowd *d, int32_t i) {
+        int32_t off = FRAMED ? sizeof(int32_t) : 0;
+        uint8_t buf[sizeof(int32_t) + sizeof(int16_t)];
+        int16_t opcode;
+        ssize_t nr  = recv(d->lobby[i], buf, off + sizeof opcode, MSG_PEEK | MSG_DONTWAIT);
+        ASSERT(d->stream.fd >= 0);
+        if (nr == 0 || (nr < 0 && errno != EAGAIN && errno != EINTR)) { /* Gone before its turn. */
+                close(d->lobby[i]);
+                lobby_del(d, i);
+                return false;
+        }
+        if (nr < off + SOF(opcode)) {
+                return false;
+        }
+        memcpy(&opcode, buf + off, sizeof opcode);
+        if (opcode == TKO) {
+                takeover(d, i);
+                return true;
+        } else if (opcode == WCH) {
+                lobby_watch(d, i);
+                return false;
+        } else if (opcode == HEL) {
+                lobby_hello(d, i);
+                return false;
+        }
+        d->parked[i] = true;
+        return false;
+}
+
+/*
+ * Fails a request of the fenced session, forgets the session once it is closed.
+ * A reply that does not fit in the socket buffer closes the session too: the
+ * client would wait for it forever, the end of the connection fails its call().
+ */
+static void fence_reply(struct escrowd *d) {
+        struct stream s  = { .flags = d->stream.flags, .fd = d->fenced };
+        int           fds[VEC_MAX];
+        int32_t       nr = 0;
+        int           result = mrecvv(&s, d->req, &nr, fds, 0);
+        for (int32_t i = 0; i < nr; ++i) {
+                close(fds[i]);
+        }
+        if (result == 0 && !(d->req->opcode & QUIET)) {
+                result = reply_on(d, d->fenced, -ESTALE, "Session taken over.");
+                if (result == -EAGAIN) {
+                        result = -ENOBUFS;
+                }
+        }
+        if (result != 0 && result != -EAGAIN) {
+                close(d->fenced);
+                d->fenced = -1;
+        }
+}
+
+/*
+ * Waits for the next request of the session or, when there is no session, for
+ * a connection. Meanwhile reaps dead descriptors, fails the requests of the
+ * fenced session, accepts connections into the lobby, hands the session over
+ * to a connection requesting a takeover, reports changes to the watchers and
+ * expires leases.
+ * All this costs a single poll(), which escrowd_loop() skips while requests
+ * are queued on the session (pipelined QUIET requests or several threads of an
+ * ESCROW_MT client), up to WAIT_EVERY requests in a row.
+ */
+static int escrowd_wait(struct escrowd *d) {
+        enum { SESSION, FENCED, LISTEN, REAP, WAITING };
+        struct pollfd pfd[WAITING + LOBBY + WATCHERS];
+        int           result;
+        while (d->stream.fd >= 0 || d->nr_lobby == 0) {
+                int32_t watching = WAITING + d->nr_lobby; /* The first watcher in pfd[]. */
+                int     timeout  = lease_run(d);
+                int     due      = watch_due(d);
+                if (timeout < 0 || (due >= 0 && due < timeout)) {
+                        timeout = due;
+                }
+                pfd[SESSION] = (struct pollfd){ .fd = d->stream.fd, .events = POLLIN };
+                pfd[FENCED]  = (struct pollfd){ .fd = d->fenced,    .events = POLLIN };
+                pfd[LISTEN]  = (struct pollfd){ .fd     = d->nr_lobby < LOBBY ? d->fd : -1,
+                                                .events = POLLIN };
+                pfd[REAP]    = (struct pollfd){ .fd = d->ep,        .events = POLLIN };
+                for (int32_t i = 0; i < d->nr_lobby; ++i) {
+                        int fd = d->parked[i] ? -1 : d->lobby[i];
+                        pfd[WAITING + i] = (struct pollfd){ .fd = fd, .events = POLLIN };
+                }
+                /* Watchers do not send anything, POLLIN is a hang-up. */
+                for (int32_t j = 0; j < d->nr_watch; ++j) {
+                        struct watcher *w      = &d->watch[j];
+                        short           events = w->blocked ? POLLIN | POLLOUT : POLLIN;
+                        pfd[watching + j] = (struct pollfd){ .fd = w->fd, .events = events };
+                }
+                result = poll(pfd, watching + d->nr_watch, timeout);
+                if (result < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        return -errno;
+                } else if (result == 0) { /* A report is due. */
+                        continue;
+                }
+                if (pfd[REAP].revents != 0 && (result = reap_pending(d)) != 0) {
+                        return result;
+                }
+                if (pfd[FENCED].revents != 0) {
+                        fence_reply(d);
+                }
+                /* Before the lobby, which might add watchers. */
+                for (int32_t j = d->nr_watch - 1; j >= 0; --j) {
+                        if ((pfd[watching + j].revents & ~POLLOUT) != 0) {
+                                watch_del(d, j);
+                        } else if (pfd[watching + j].revents != 0) {
+                                d->watch[j].blocked = false;
+                        }
+                }
+                /* Downwards: lobby_del() shifts the tail. */
+                for (int32_t i = d->nr_lobby - 1; i >= 0; --i) {
+                        if (pfd[WAITING + i].revents != 0 && lobby_peek(d, i)) {
+                                return 0; /* The TKO request is waiting in the new session. */
+                        }
+                }
+                if (pfd[LISTEN].revents != 0) {
+                        int fd = accept(d->fd, NULL, NULL);
+                        if (fd >= 0) {
+                                d->parked[d->nr_lobby] = false;
+                                d->lobby[d->nr_lobby++] = fd;
+                        }
+                }
+                if (pfd[SESSION].revents != 0) {
+                        break;
+                }
+        }
+        return 0;
+}
+
+int escrowd_init(struct escrowd **out, const char *path, uint32_t flags, int32_t nr_tags,
+                 const struct escrow_quota *quota) {
+        struct sockaddr_un address;
+        int                result;
+        mode_t             mask;
+        struct tag        *tags = mem_alloc(nr_tags * sizeof tags[0]);
+        struct escrowd    *d    = mem_alloc(sizeof *d);
+        if (d == NULL || tags == NULL) {
                 mem_free(d);
                 mem_free(tags);
                 EV(flags, warn("Cannot allocate escrowd."));
                 return ERROR(-ENOMEM);
         }
-        d->stream.flags = flags;
-        if (flags & ESCROW_FORCE) {
-                unlink(path);
+        d->stream.flags = flags;
+        d->stream.fd    = -1;
+        d->fenced       = -1;
+        if (quota != NULL) {
+                d->max = *quota;
+                result = fd_budget(quota->fds);
+                if (result != 0) {
+                        EV(flags, warn("Cannot raise RLIMIT_NOFILE to %i.", quota->fds + FD_SLACK));
+                        return ERROR(result);
+                }
+        }
+        if (flags & ESCROW_URING) {
+                d->stream.ring = ring_init();
+                EV(flags, OUT("io_uring is %savailable.\n", d->stream.ring == NULL ? "not " : ""));
+        }
+        if (flags & ESCROW_FORCE) {
+                unlink(path);
+        }
+        if (strlen(path) >= sizeof(address.sun_path) - 1) {
+                EV(flags, warn("Path is too long: \"%s\"", path));
+                return ERROR(-EINVAL);
+        }
+        if ((d->fd = socket(AF_UNIX, SOCK_TYPE, 0)) < 0) {
+                EV(flags, warn("socket()"));
+                return ERROR(-errno);
+        }
+        address.sun_family = AF_UNIX;
+        strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+        mask = umask(0777 & ~(S_IRUSR | S_IWUSR)); /* rw------- */
+        result = bind(d->fd, (struct sockaddr *)&address, sizeof(address));
+        umask(mask);
+        if (result < 0) {
+                EV(flags, warn("bind()"));
+                return ERROR(-errno);
+        }
+        if (listen(d->fd, QUEUE) < 0) {
+                EV(flags, warn("listen()"));
+                return ERROR(-errno);
+        }
+        result = reap_init(d);
+        if (result != 0) {
+                EV(flags, warn("epoll_create1()"));
+                return ERROR(result);
+        }
+        EV(flags, OUT("Listening on \"%s\"\n", path));
+        d->tags = tags;
+        d->path = path;
+        d->nr_tags = nr_tags;
+        for (int32_t i = 0; i < nr_tags; ++i) {
+                seq_init(&d->tags[i].seq);
+        }
+        if (mirror_init(d) != 0) { /* Not fatal: the clients go without shadows. */
+                EV(flags, warn("Cannot create the mirror."));
+        }
+        *out = d;
+        return 0;
+}
+
+void escrowd_fini(struct escrowd *d) {
+        for (int32_t i = 0; i < d->nr_tags; ++i) {
+                struct seq *s   = &d->tags[i].seq;
+                int32_t     max = seq_nr(s);
+                for (int32_t j = 0; j < max; ++j) {
+                        struct slot *slot = seq_get(s, j);
+                        if (slot != NULL) {
+                                slot_fini(d, slot);
+                        }
+                }
+                seq_fini(&d->tags[i].seq);
+                lease_del(d, d->tags[i].lease);
+        }
+        lease_del(d, d->lease);
+        mem_free(d->tags);
+        mem_free(d->blobs);
+        mem_free(d->zbuf);
+        mem_free(d->unz);
+        ring_fini(d->stream.ring);
+        if (d->ep >= 0) {
+                close(d->ep);
+        }
+        for (int32_t i = 0; i < d->nr_lobby; ++i) {
+                close(d->lobby[i]);
+        }
+        while (d->nr_watch > 0) {
+                watch_del(d, d->nr_watch - 1);
+        }
+        mem_free(d->evt);
+        mirror_fini(d);
+        if (d->fenced >= 0) {
+                close(d->fenced);
+        }
+        if (d->stream.fd >= 0) {
+                close(d->stream.fd);
+        }
+        close(d->fd);
+        unlink(d->path);
+}
+
+int escrowd_loop(struct escrowd *d) {
+        struct msg  m   = {};
+        struct mrep rep = {};
+        int         fds[VEC_MAX];
+        int32_t     nr;
+        int         fd;
+        bool        remote;
+        bool        queued = false; /* The next request is likely there already. */
+        int32_t     streak = 0;     /* Requests received without escrowd_wait(). */
+        int         result;
+        d->req = &m;
+        d->rep = &rep;
+        result = escrowd_wait(d);
+        if (result != 0) {
+                return result;
+        }
+        d->stream.fd = d->lobby[0];
+        lobby_del(d, 0);
+        d->nr_err = 0; /* Failures of the previous session are not this one's. */
+        while (true) {
+                nr = 0;
+                result = queued && streak < WAIT_EVERY ?
+                        mrecvv(&d->stream, &m, &nr, fds, MSG_DONTWAIT) : -EAGAIN;
+                if (result == -EAGAIN) {
+                        streak = 0;
+                        result = escrowd_wait(d) ?: mrecvv(&d->stream, &m, &nr, fds, 0);
+                } else {
+                        ++streak;
+                }
+                if (result != 0) {
+                        for (int32_t i = 0; i < nr; ++i) {
+                                close(fds[i]);
+                        }
+                        break;
+                }
+                d->quiet = (m.opcode & QUIET) != 0;
+                /* The client does not wait for a reply before the next request. */
+                queued   = streak > 0 || d->quiet;
+                remote   = (m.opcode & REMOTE) != 0;
+                m.opcode &= ~(QUIET | REMOTE);
+                if (d->quiet && m.opcode != ADD && m.opcode != DEL && m.opcode != REF &&
+                    m.opcode != VEC && m.opcode != LSE && m.opcode != DMP) {
+                        d->quiet = false; /* Other requests always reply. */
+                }
+                fd = nr > 0 ? fds[0] : -1;
+                /* Only VEC and DMP pass multiple descriptors. */
+                for (int32_t i = 1; i < nr && m.opcode != VEC && m.opcode != DMP; ++i) {
+                        close(fds[i]);
+                }
+                switch (m.opcode) {
+                case ADD:
+                        result = remote ? add_remote(d, &m.add, fd) : add(d, &m.add, fd);
+                        break;
+                case REF:
+                        result = ref(d, &m.ref, fd);
+                        break;
+                case DEL:
+                        result = del(d, &m.del, fd);
+                        break;
+                case TAG:
+                        result = tag(d, &m.tag, fd);
+                        break;
+                case GET:
+                        result = get(d, &m.get, fd);
+                        break;
+                case SET:
+                        result = set(d, &m.set, fd);
+                        break;
+                case REC:
+                        result = rec(d, &m.rec, fd);
+                        break;
+                case STA:
+                        result = sta(d, &m.sta, fd);
+                        break;
+                case MAN:
+                        result = manifest(d, &m.man, fd);
+                        break;
+                case SYN:
+                        result = syn(d, &m.err, fd);
+                        break;
+                case VEC:
+                        result = vec(d, &m.vec, nr, fds);
+                        fd = -1;
+                        break;
+                case VGT:
+                        result = vgt(d, &m.tag, fd);
+                        break;
+                case TKO:
+                        result = tko(d, &m.tag, fd);
+                        break;
+                case CLR:
+                        result = clr(d, &m.clr, fd);
+                        break;
+                case WCH:
+                        result = wch(d, &m.wch, fd);
+                        break;
+                case LSE:
+                        result = lse(d, &m.lse, fd);
+                        break;
+                case HEL:
+                        result = hel(d, &d->stream, &m.hel, fd);
+                        break;
+                case DMP:
+                        result = dmp(d, &m.dmp, nr, fds);
+                        fd = -1;
+                        break;
+                default:
+                        result = reply(d, -EPROTO, "Unexpected message type.");
+                }
+                /* Only ADD and REF take the descriptor over. */
+                if (m.opcode != ADD && m.opcode != REF && fd >= 0) {
+                        close(fd);
+                }
+                if (result != 0 || d->stream.fd < 0) {
+                        break;
+                }
+        }
+        owner_put(d->owner);
+        d->owner = NULL;
+        if (d->stream.fd >= 0) {
+                close(d->stream.fd);
+                d->stream.fd = -1;
+        }
+        return result;
+}
+
+int escrowd(const char *path, uint32_t flags, int32_t nr_tags, const struct escrow_quota *quota) {
+        struct escrowd *d;
+        int             result = escrowd_init(&d, path, flags, nr_tags, quota);
+        if (result != 0) {
+                errx(EXIT_FAILURE, "escrowd_init(): %i", result);
+        }
+        while (true) {
+                int result = escrowd_loop(d);
+                EV(flags, OUT("Session completed with %i.\n", result));
+        }
+        escrowd_fini(d);
+        return 0;
+}
+
+/*
+ * Handlers installed by the client would make escrowd ignore, e.g., SIGTERM.
+ * Ignored signals stay ignored.
+ */
+static void signals_reset(void) {
+        sigset_t none;
+        for (int signo = 1; signo < NSIG; ++signo) {
+                struct sigaction sa;
+                if (sigaction(signo, NULL, &sa) == 0 &&
+                    sa.sa_handler != SIG_IGN && sa.sa_handler != SIG_DFL) {
+                        sa.sa_handler = SIG_DFL;
+                        sa.sa_flags   = 0;
+                        sigaction(signo, &sa, NULL);
+                }
+        }
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+}
+
+int escrowd_fork(const char *path, uint32_t flags, int32_t nr_tags) {
+        static const char escrowd_name[] = "escrowd";
+        int result = fork();
+        if (result == 0) {
+                op_cur = NULL; /* Forked in escrow_init(). */
+                signals_reset();
+                result = daemon(true, true) ?:
+#if defined(__linux__)
+                         prctl(PR_SET_NAME, escrowd_name, 0, 0, 0)
+#elif defined(__APPLE__)
+                         (setprogname(escrowd_name), 0)
+#else
+                         0
+#endif
+                         ;
+                if (result == 0) {
+                        result = escrowd(path, flags, nr_tags, NULL);
+                } else {
+                        result = -errno;
+                }
+        } else if (result > 0) {
+                sleep(FORK_DELAY);
+                result = 0;
+        }
+        return result;
+}
+
+/* @seq  */
+
+static void seq_init(struct seq *s) {
+        ASSERT(IS0(s));
+}
+
+static void seq_fini(struct seq *s) {
+        for (int32_t i = 0; i < ARRAY_SIZE(s->root); ++i) {
+                mem_free(s->root[i]);
+        }
+}
+
+static int seq_add(struct seq *s, int32_t idx, void *val) {
+        int32_t rix = idx >> LEAF_SHIFT;
+        ASSERT(idx < MAX_IDX);
+        if (UNLIKELY(s->root[rix] == NULL)) {
+                s->root[rix] = mem_alloc(sizeof(uint64_t) << LEAF_SHIFT);
+                if (UNLIKELY(s->root[rix] == NULL)) {
+                        return ERROR(-ENOMEM);
+                }
+        }
+        s->root[rix][idx & MASK(LEAF_SHIFT)] = val;
+        return 0;
+}
+
+static void seq_del(struct seq *s, int32_t idx) {
+        int32_t rix = idx >> LEAF_SHIFT;
+        ASSERT(idx < MAX_IDX);
+        if (LIKELY(s->root[rix] != NULL)) {
+                s->root[rix][idx & MASK(LEAF_SHIFT)] = 0;
+        }
+}
+
+/* Removes the values with indices in [IDX, END), calling CB for each. */
+static void seq_cut(struct seq *s, int32_t idx, int32_t end, void (*cb)(void *, void *),
+                    void *arg) {
+        ASSERT(0 <= idx && end <= MAX_IDX);
+        for (int32_t rix = idx >> LEAF_SHIFT; idx < end; ++rix, idx = rix << LEAF_SHIFT) {
+                void  **leaf = s->root[rix];
+                int32_t lo   = idx & MASK(LEAF_SHIFT);
+                int32_t hi   = min_32(end - (rix << LEAF_SHIFT), 1 << LEAF_SHIFT);
+                if (leaf == NULL) {
+                        continue;
+                }
+                for (int32_t lix = lo; lix < hi; ++lix) {
+                        if (leaf[lix] != NULL) {
+                                cb(arg, leaf[lix]);
+                                leaf[lix] = NULL;
+                        }
+                }
+                if (lo == 0 && hi == 1 << LEAF_SHIFT) {
+                        mem_free(leaf);
+                        s->root[rix] = NULL;
+                }
+        }
+}
+
+static void *seq_get(const struct seq *s, int32_t idx) {
+        int32_t rix = idx >> LEAF_SHIFT;
+        ASSERT(idx < MAX_IDX);
+        if (LIKELY(s->root[rix] != NULL)) {
+                return s->root[rix][idx & MASK(LEAF_SHIFT)];
+        } else {
+                return NULL;
+        }
+}
+
+static int32_t seq_nr(const struct seq *s) {
+        for (int32_t rix = ARRAY_SIZE(s->root) - 1; rix >= 0; --rix) {
+                if (s->root[rix] != NULL) {
+                        for (int32_t lix = (1 << LEAF_SHIFT) - 1; lix >= 0; --lix) {
+                                if (s->root[rix][lix] != 0) {
+                                        return (rix << ROOT_SHIFT) + lix + 1;
+                                }
+                        }
+                }
+        }
+        return 0;
+}
+
+static int32_t seq_next(const struct seq *s, int32_t idx) {
+        for (int32_t rix = idx >> LEAF_SHIFT; rix < ARRAY_SIZE(s->root); ++rix, idx = 0) {
+                if (s->root[rix] != NULL) {
+                        for (int32_t lix = idx & MASK(LEAF_SHIFT); lix < (1 << LEAF_SHIFT); ++lix) {
+                                if (s->root[rix][lix] != NULL) {
+                                        return (rix << LEAF_SHIFT) + lix;
+                                }
+                        }
+                }
+        }
+        return -1;
+}
+
+static void io_send(struct io *io, const void *hdr, int32_t hnob, const void *data, int32_t nob,
+                    int fd) {
+        io->len    = hnob + nob;
+        io->in     = fd;
+        io->fd     = NULL;
+        io->iov[0] = (struct iovec){ &io->len,     sizeof io->len };
+        io->iov[1] = (struct iovec){ (void *)hdr,  hnob };
+        io->iov[2] = (struct iovec){ (void *)data, nob };
+        io->hdr    = (struct msghdr){
+                .msg_iov    = FRAMED ? &io->iov[0] : &io->iov[1],
+                .msg_iovlen = FRAMED ? 3 : 2
+        };
+        if (fd >= 0) {
+                struct cmsghdr *cmsgp = &io->ctrl.hdr;
+                io->hdr.msg_control    = io->ctrl.buf;
+                io->hdr.msg_controllen = sizeof io->ctrl.buf;
+                cmsgp->cmsg_level = SOL_SOCKET;
+                cmsgp->cmsg_type  = SCM_RIGHTS;
+                cmsgp->cmsg_len   = CMSG_LEN(sizeof fd);
+                memcpy(CMSG_DATA(cmsgp), &fd, sizeof fd);
+        }
+}
+
+static void io_recv(struct io *io, void *buf, int32_t nob, int *fd) {
+        io->in     = -1;
+        io->fd     = fd;
+        io->iov[0] = (struct iovec){ &io->len, sizeof io->len };
+        io->iov[1] = (struct iovec){ buf,      nob };
+        io->hdr    = (struct msghdr){
+                .msg_iov        = &io->iov[1],
+                .msg_iovlen     = 1,
+                .msg_control    = io->ctrl.buf,
+                .msg_controllen = sizeof io->ctrl.buf
+        };
+        SET0(&io->ctrl);
+        *fd = -1;
+}
+
+/*
+ * Extracts the received descriptor. The control buffer is zeroed in advance, so
+ * msg_controllen is not needed (io_uring does not update it).
+ */
+static int io_fd(struct io *io) {
+        struct cmsghdr *cmsgp = &io->ctrl.hdr;
+        if (cmsgp->cmsg_len == 0) {
+                return 0;
+        }
+        if (cmsgp->cmsg_len != CMSG_LEN(sizeof *io->fd) ||
+            cmsgp->cmsg_level != SOL_SOCKET || cmsgp->cmsg_type != SCM_RIGHTS) {
+                return -EPROTO;
+        }
+        memcpy(io->fd, CMSG_DATA(cmsgp), sizeof *io->fd);
+        return 0;
+}
+
+/* Accounts a message of NOB bytes with NR descriptors to the operation. */
+static int op_add(struct op *op, bool send, int32_t nob, int32_t nr) {
+        if (op != NULL) {
+                if (send) {
+                        op->info.sent     += nob;
+                        op->info.fds_sent += nr;
+                } else {
+                        op->info.recv     += nob;
+                        op->info.fds_recv += nr;
+                }
+        }
+        return 0;
+}
+
+/* Accounts a completed message to the operation in progress, if any. */
+static int op_io(const struct io *io) {
+        return op_add(op_cur, io->fd == NULL, io->len, io->fd == NULL ? io->in >= 0 : *io->fd >= 0);
+}
+
+static int io_exec(int socket, struct io *io) {
+        ssize_t nr;
+        if (io->fd == NULL) {
+                return sendmsg(socket, &io->hdr, 0) == -1 ? -errno : op_io(io);
+        }
+        if (FRAMED) { /* Receive the length (and the descriptor), then the message. */
+                io->hdr.msg_iov = &io->iov[0];
+        }
+        nr = recvmsg(socket, &io->hdr, 0);
+        if (nr == -1) {
+                return -errno;
+        } else if (nr == 0) {
+                return -ESHUTDOWN;
+        }
+        if (FRAMED) {
+                if (nr != sizeof io->len || io->len < 0 || io->len > (int32_t)io->iov[1].iov_len) {
+                        return -EPROTO;
+                }
+                nr = recv(socket, io->iov[1].iov_base, io->len, MSG_WAITALL);
+                if (nr == -1) {
+                        return -errno;
+                } else if (nr != io->len) {
+                        return -ESHUTDOWN;
+                }
+        } else {
+                io->len = nr;
+        }
+        return io_fd(io) ?: op_io(io);
+}
+
+static int ring_run(struct ring *ring, int socket, int32_t nr, struct io *io);
+
+/*
+ * Executes a batch of sends and receives on the socket in order. A failed
+ * operation cancels the rest of the batch (-ECANCELED). With a ring,
+ * the entire batch costs a single io_uring_enter(), otherwise a system call per
+ * message. Individual results are returned in io[]::result.
+ */
+static void io_run(struct ring *ring, int socket, int32_t nr, struct io *io) {
+        if (ring == NULL || ring_run(ring, socket, nr, io) != 0) {
+                int result = 0;
+                /* A failure cancels the rest, as in a linked chain. */
+                for (int32_t i = 0; i < nr; ++i) {
+                        io[i].result = result = result == 0 ? io_exec(socket, &io[i]) : -ECANCELED;
+                }
+        }
+}
+
+static int send_fd(int socket, int32_t nob, const void *data, int fd) {
+        struct io io;
+        io_send(&io, data, nob, NULL, 0, fd);
+        return io_exec(socket, &io);
+}
+
+union vctrl {
+        char           buf[CMSG_SPACE(VEC_MAX * sizeof (int))];
+        struct cmsghdr hdr;
+};
+
+/* Sends a message with NR (up to VEC_MAX) descriptors. */
+static int vec_send(int socket, const void *data, int32_t nob, int32_t nr, const int *fd) {
+        union vctrl   ctrl   = {};
+        int32_t       len    = nob;
+        struct iovec  iov[2] = { { &len, sizeof len }, { (void *)data, nob } };
+        struct msghdr hdr    = {
+                .msg_iov    = FRAMED ? &iov[0] : &iov[1],
+                .msg_iovlen = FRAMED ? 2 : 1
+        };
+        ASSERT(0 <= nr && nr <= VEC_MAX);
+        if (nr > 0) {
+                hdr.msg_control    = ctrl.buf;
+                hdr.msg_controllen = CMSG_SPACE(nr * sizeof fd[0]);
+                ctrl.hdr.cmsg_level = SOL_SOCKET;
+                ctrl.hdr.cmsg_type  = SCM_RIGHTS;
+                ctrl.hdr.cmsg_len   = CMSG_LEN(nr * sizeof fd[0]);
+                memcpy(CMSG_DATA(&ctrl.hdr), fd, nr * sizeof fd[0]);
+        }
+        return sendmsg(socket, &hdr, 0) == -1 ? -errno : op_add(op_cur, true, nob, nr);
+}
+
+/*
+ * Receives a message with up to VEC_MAX descriptors. The descriptors received
+ * are returned in FD[0 .. *NR), even if the call fails.
+ */
+static int vec_recv(int socket, void *data, int32_t nob, int32_t *nr, int *fd, int flags) {
+        union vctrl   ctrl   = {};
+        int32_t       len;
+        struct iovec  iov[2] = { { &len, sizeof len }, { data, nob } };
+        struct msghdr hdr    = {
+                .msg_iov        = FRAMED ? &iov[0] : &iov[1],
+                .msg_iovlen     = 1,
+                .msg_control    = ctrl.buf,
+                .msg_controllen = sizeof ctrl.buf
+        };
+        ssize_t       got    = recvmsg(socket, &hdr, flags);
+        *nr = 0;
+        if (got == -1) {
+                return -errno;
+        } else if (got == 0) {
+                return -ESHUTDOWN;
+        }
+        if (ctrl.hdr.cmsg_len != 0) {
+                if (ctrl.hdr.cmsg_level != SOL_SOCKET || ctrl.hdr.cmsg_type != SCM_RIGHTS) {
+                        return -EPROTO;
+                }
+                *nr = (ctrl.hdr.cmsg_len - CMSG_LEN(0)) / sizeof fd[0];
+                memcpy(fd, CMSG_DATA(&ctrl.hdr), *nr * sizeof fd[0]);
+        }
+        if (hdr.msg_flags & MSG_CTRUNC) {
+                return -EPROTO;
+        }
+        if (FRAMED) { /* As in io_exec(). */
+                if (got != sizeof len || len < 0 || len > nob) {
+                        return -EPROTO;
+                }
+                got = recv(socket, data, len, MSG_WAITALL);
+                if (got == -1) {
+                        return -errno;
+                } else if (got != len) {
+                        return -ESHUTDOWN;
+                }
+        }
+        return op_add(op_cur, false, got, *nr);
+}
+
+static int recv_fd(int socket, int32_t nob, void *data, int *fd) {
+        struct io io;
+        io_recv(&io, data, nob, fd);
+        return io_exec(socket, &io);
+}
+
+/* @uring */
+
+#if defined(HAS_URING)
+
+struct ring {
+        int                  fd;
+        uint32_t             entries;
+        uint32_t            *sq_head;
+        uint32_t            *sq_tail;
+        uint32_t            *sq_mask;
+        uint32_t            *sq_array;
+        uint32_t            *cq_head;
+        uint32_t            *cq_tail;
+        uint32_t            *cq_mask;
+        struct io_uring_sqe *sqes;
+        struct io_uring_cqe *cqes;
+        void                *sq;
+        void                *cq;
+        size_t               sq_len;
+        size_t               cq_len;
+        size_t               sqes_len;
+};
+
+static struct ring *ring_init(void) {
+        struct io_uring_params p    = {};
+        struct ring           *ring = mem_alloc(sizeof *ring);
+        if (ring == NULL) {
+                return NULL;
+        }
+        ring->fd = syscall(__NR_io_uring_setup, 2 * BATCH, &p);
+        if (ring->fd < 0) {
+                mem_free(ring);
+                return NULL;
+        }
+        ring->entries  = p.sq_entries;
+        ring->sq_len   = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+        ring->cq_len   = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+        ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+                ring->sq_len = ring->cq_len =
+                        ring->sq_len > ring->cq_len ? ring->sq_len : ring->cq_len;
+        }
+        ring->sq   = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          ring->fd, IORING_OFF_SQ_RING);
+        ring->cq   = (p.features & IORING_FEAT_SINGLE_MMAP) ? ring->sq :
+                mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     ring->fd, IORING_OFF_CQ_RING);
+        ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          ring->fd, IORING_OFF_SQES);
+        if (ring->sq == MAP_FAILED || ring->cq == MAP_FAILED || ring->sqes == MAP_FAILED) {
+                ring_fini(ring);
+                return NULL;
+        }
+        ring->sq_head  = ring->sq + p.sq_off.head;
+        ring->sq_tail  = ring->sq + p.sq_off.tail;
+        ring->sq_mask  = ring->sq + p.sq_off.ring_mask;
+        ring->sq_array = ring->sq + p.sq_off.array;
+        ring->cq_head  = ring->cq + p.cq_off.head;
+        ring->cq_tail  = ring->cq + p.cq_off.tail;
+        ring->cq_mask  = ring->cq + p.cq_off.ring_mask;
+        ring->cqes     = ring->cq + p.cq_off.cqes;
+        return ring;
+}
+
+static void ring_fini(struct ring *ring) {
+        if (ring != NULL) {
+                if (ring->sqes != NULL && ring->sqes != MAP_FAILED) {
+                        munmap(ring->sqes, ring->sqes_len);
+                }
+                if (ring->cq != NULL && ring->cq != MAP_FAILED && ring->cq != ring->sq) {
+                        munmap(ring->cq, ring->cq_len);
+                }
+                if (ring->sq != NULL && ring->sq != MAP_FAILED) {
+                        munmap(ring->sq, ring->sq_len);
+                }
+                close(ring->fd);
+                mem_free(ring);
+        }
+}
+
+static int ring_enter(struct ring *ring, uint32_t submit, uint32_t wait) {
+        int result = syscall(__NR_io_uring_enter, ring->fd, submit, wait,
+                             IORING_ENTER_GETEVENTS, NULL, 0);
+        return result == -1 ? -errno : result;
+}
+
+/*
+ * Submits the batch as a chain of linked SENDMSG and RECVMSG operations, so that
+ * they are executed in order, and waits for all completions in the same call.
+ */
+static int ring_run(struct ring *ring, int socket, int32_t nr, struct io *io) {
+        uint32_t tail = *ring->sq_tail;
+        uint32_t left;
+        int32_t  done = 0;
+        int      result;
+        ASSERT(nr <= (int32_t)ring->entries);
+        for (int32_t i = 0; i < nr; ++i) {
+                uint32_t             idx = tail++ & *ring->sq_mask;
+                struct io_uring_sqe *sqe = &ring->sqes[idx];
+                SET0(sqe);
+                sqe->opcode    = io[i].fd == NULL ? IORING_OP_SENDMSG : IORING_OP_RECVMSG;
+                sqe->fd        = socket;
+                sqe->addr      = (uintptr_t)&io[i].hdr;
+                sqe->len       = 1;
+                sqe->flags     = i + 1 < nr ? IOSQE_IO_LINK : 0;
+                sqe->user_data = i;
+                ring->sq_array[idx] = idx;
+        }
+        __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+        result = ring_enter(ring, nr, nr);
+        if (result < 0) { /* Nothing was submitted, withdraw the batch. */
+                __atomic_store_n(ring->sq_tail, tail - nr, __ATOMIC_RELEASE);
+                return result;
+        }
+        while (true) {
+                uint32_t head = *ring->cq_head;
+                while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+                        struct io_uring_cqe *cqe = &ring->cqes[head++ & *ring->cq_mask];
+                        struct io           *cur = &io[cqe->user_data];
+                        if (cqe->res < 0) {
+                                cur->result = cqe->res;
+                        } else if (cur->fd == NULL) {
+                                cur->result = op_io(cur);
+                        } else if (cqe->res == 0) {
+                                cur->result = -ESHUTDOWN;
+                        } else {
+                                cur->len    = cqe->res;
+                                cur->result = io_fd(cur) ?: op_io(cur);
+                        }
+                        ++done;
+                }
+                __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+                if (done == nr) {
+                        return 0;
+                }
+                /*
+                 * Submits whatever the first call left behind and waits for
+                 * the rest. The batch is in flight and cannot be abandoned.
+                 */
+                left   = *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+                result = ring_enter(ring, left, nr - done);
+                ASSERT(result >= 0 || result == -EINTR || result == -EAGAIN || result == -EBUSY);
+        }
+}
+
+#else
+
+struct ring;
+
+static struct ring *ring_init(void) {
+        return NULL;
+}
+
+static void ring_fini(struct ring *ring) {
+}
+
+static int ring_run(struct ring *ring, int socket, int32_t nr, struct io *io) {
+        return -ENOSYS;
+}
+
+#endif
+
+/* @pidfd */
+
+/*
+ * ESCROW_PIDFD: a process fetches descriptors of another process directly with
+ * pidfd_getfd(2) (Linux 5.6), which needs PTRACE_MODE_ATTACH_REALCREDS access
+ * to the process (same user and no Yama restriction, or CAP_SYS_PTRACE).
+ */
+
+#if defined(HAS_PIDFD)
+
+static int pid_open(pid_t pid) {
+        int pidfd = syscall(SYS_pidfd_open, pid, 0);
+        return pidfd >= 0 ? pidfd : -errno;
+}
+
+/* Returns a pidfd of the process at the other end of the UNIX domain socket. */
+static int pid_peer(int socket) {
+        struct ucred cred;
+        socklen_t    nob = sizeof cred;
+        return getsockopt(socket, SOL_SOCKET, SO_PEERCRED, &cred, &nob) == 0 && cred.pid > 0 ?
+                pid_open(cred.pid) : -ESRCH; /* The peer pid is 0 in a foreign pid namespace. */
+}
+
+static int pid_getfd(int pidfd, int fd) {
+        int result = syscall(SYS_pidfd_getfd, pidfd, fd, 0);
+        return result >= 0 ? result : -errno;
+}
+
+/*
+ * The file the descriptor refers to, so that a descriptor fetched by number is
+ * not taken for another one, after the owner closed the descriptor and reused
+ * the number. Never 0.
+ */
+static uint64_t file_id(int fd) {
+        struct stat st;
+        uint64_t    key[2] = {};
+        if (fstat(fd, &st) == 0) {
+                key[0] = st.st_dev;
+                key[1] = st.st_ino;
+        }
+        return escrow_hash(key, sizeof key) | 1;
+}
+
+#else
+
+static int pid_open(pid_t pid) {
+        return -ENOSYS;
+}
+
+static int pid_peer(int socket) {
+        return -ENOSYS;
+}
+
+static int pid_getfd(int pidfd, int fd) {
+        return -ENOSYS;
+}
+
+static uint64_t file_id(int fd) {
+        return 1;
+}
+
+#endif
+
+/* @zip */
+
+/*
+ * A byte-oriented LZ77 compressor in the spirit of LZ4. The compressed stream
+ * is a sequence of
+ *
+ *     token literals offset
+ *
+ * where the high and low nibbles of the token are the literal count and the
+ * match length minus ZIP_MIN (15 means that more length bytes follow, each 255
+ * meaning "continued"), and the 2-byte little-endian offset points back into the
+ * output. The last sequence consists of the token and the literals only.
+ */
+
+enum {
+        ZIP_HASH = 12,
+        ZIP_MIN  = 4
+};
+
+static uint32_t zip_load(const uint8_t *p) {
+        uint32_t v;
+        memcpy(&v, p, sizeof v);
+        return v;
+}
+
+static uint32_t zip_hash(const uint8_t *p) {
+        return (zip_load(p) * 2654435761u) >> (32 - ZIP_HASH);
+}
+
+static uint8_t *zip_len(uint8_t *out, int32_t len) {
+        for (; len >= 255; len -= 255) {
+                *out++ = 255;
+        }
+        *out++ = len;
+        return out;
+}
+
+static uint8_t *zip_seq(uint8_t *out, const uint8_t *lit, int32_t nob, int32_t off, int32_t len) {
+        uint8_t *token = out++;
+        *token = min_32(nob, 15) << 4 | (off > 0 ? min_32(len - ZIP_MIN, 15) : 0);
+        if (nob >= 15) {
+                out = zip_len(out, nob - 15);
+        }
+        memcpy(out, lit, nob);
+        out += nob;
+        if (off > 0) {
+                *out++ = off & 0xff;
+                *out++ = off >> 8;
+                if (len - ZIP_MIN >= 15) {
+                        out = zip_len(out, len - ZIP_MIN - 15);
+                }
+        }
+        return out;
+}
+
+/* Worst case size of a sequence. */
+static int32_t zip_max(int32_t nob, int32_t len) {
+        return 1 + nob / 255 + 1 + nob + 2 + len / 255 + 1;
+}
+
+/* Returns the size of the compressed data, or -1 if it does not fit in CAP bytes. */
+static int32_t zip(const uint8_t *in, int32_t nob, uint8_t *out, int32_t cap) {
+        uint16_t       table[1 << ZIP_HASH] = {};
+        const uint8_t *ip     = in;
+        const uint8_t *anchor = in;
+        const uint8_t *end    = in + nob;
+        uint8_t       *op     = out;
+        ASSERT(nob <= UINT16_MAX);
+        while (end - ip >= ZIP_MIN) {
+                uint32_t       h   = zip_hash(ip);
+                const uint8_t *ref = in + table[h];
+                table[h] = ip - in;
+                if (ref < ip && zip_load(ref) == zip_load(ip)) {
+                        int32_t len = ZIP_MIN;
+                        while (ip + len < end && ref[len] == ip[len]) {
+                                ++len;
+                        }
+                        if (op - out + zip_max(ip - anchor, len) > cap) {
+                                return -1;
+                        }
+                        op = zip_seq(op, anchor, ip - anchor, ip - ref, len);
+                        anchor = ip += len;
+                } else {
+                        ++ip;
+                }
+        }
+        if (op - out + zip_max(end - anchor, 0) > cap) {
+                return -1;
+        }
+        return zip_seq(op, anchor, end - anchor, 0, 0) - out;
+}
+
+static int32_t zip_ext(const uint8_t **ip, const uint8_t *end, int32_t len) {
+        uint8_t b;
+        if (len == 15) {
+                do {
+                        if (*ip == end) {
+                                return -1;
+                        }
+                        b = *(*ip)++;
+                        len += b;
+                } while (b == 255);
+        }
+        return len;
+}
+
+/* Returns the size of the decompressed data, or -1 if the input is corrupted. */
+static int32_t unzip(const uint8_t *in, int32_t zob, uint8_t *out, int32_t cap) {
+        const uint8_t *ip  = in;
+        const uint8_t *end = in + zob;
+        uint8_t       *op  = out;
+        while (ip < end) {
+                uint8_t token = *ip++;
+                int32_t nob   = zip_ext(&ip, end, token >> 4);
+                int32_t off;
+                int32_t len;
+                if (nob < 0 || nob > end - ip || nob > out + cap - op) {
+                        return -1;
+                }
+                memcpy(op, ip, nob);
+                op += nob;
+                ip += nob;
+                if (ip == end) {
+                        break;
+                }
+                if (end - ip < 2) {
+                        return -1;
+                }
+                off = ip[0] | ip[1] << 8;
+                ip += 2;
+                len = zip_ext(&ip, end, token & 15);
+                if (len < 0 || off == 0 || off > op - out || len + ZIP_MIN > out + cap - op) {
+                        return -1;
+                }
+                for (int32_t i = 0; i < len + ZIP_MIN; ++i) { /* Matches can overlap. */
+                        op[i] = op[i - off];
+                }
+                op += len + ZIP_MIN;
+        }
+        return op - out;
+}
+
+/* @hash */
+
+static uint64_t rotl_64(uint64_t x, int n) {
+        return x << n | x >> (64 - n);
+}
+
+static uint64_t hash_mix(uint64_t x) {
+        x ^= x >> 33;
+        x *= 0xff51afd7ed558ccdull;
+        x ^= x >> 33;
+        x *= 0xc4ceb9fe1a85ec53ull;
+        return x ^ x >> 33;
+}
+
+/* MurmurHash64-like: a word at a time, mixed at the end. */
+uint64_t escrow_hash(const void *data, int32_t nob) {
+        const uint8_t *p = data;
+        uint64_t       h = 0x9e3779b97f4a7c15ull ^ nob;
+        uint64_t       w;
+        for (; nob >= SOF(w); nob -= SOF(w), p += SOF(w)) {
+                memcpy(&w, p, sizeof w);
+                h ^= rotl_64(w * 0x87c37b91114253d5ull, 31) * 0x4cf5ad432745937full;
+                h  = rotl_64(h, 27) * 5 + 0x52dce729;
+        }
+        w = 0;
+        memcpy(&w, p, nob);
+        h ^= rotl_64(w * 0x87c37b91114253d5ull, 31) * 0x4cf5ad432745937full;
+        return hash_mix(h);
+}
+
+static void *mem_alloc(int32_t size) {
+        return calloc(1, size);
+}
+
+static void mem_free(void *mem) {
+        free(mem);
+}
+
+/* @client */
+
+/*
+ * A request submitted by a thread of an ESCROW_MT client.
+ *
+ * The submitting thread pushes the request to the lock-free escrow::queue. The
+ * thread that manages to grab escrow::lock becomes the "driver": it takes all
+ * queued requests, sends them over the connection in windows of up to WINDOW
+ * requests and receives the replies. Escrowd processes a connection strictly in
+ * order, so the replies are matched to the requests positionally. The other
+ * threads sleep on their own requests' condition variables.
+ */
+struct req {
+        struct req     *next;
+        struct msg     *m;   /* Request, overwritten by the reply. */
+        int             in;  /* Descriptor to send. */
+        int            *out; /* Received descriptor. */
+        struct op      *op;  /* The submitter's operation. */
+        int             result;
+        bool            done;
+        pthread_cond_t  cond;
+};
+
+enum {
+        WINDOW     = 16,
+        WINDOW_NOB = 1 << 16,
+        DEDUP_MIN  = 64,     /* Smaller payloads are always sent. */
+        DEDUP_NR   = 1 << 10
+};
+
+/* An entry of the emergency dump table, unused while rec.tag is negative. */
+struct dent {
+        struct mdrec rec;
+        const void  *data;
+};
+
+/* Emergency dump table, with everything escrow_dump() needs preallocated. */
+struct dump {
+        int32_t      nr;
+        int32_t      len; /* FRAMED length prefix. */
+        struct {
+                int16_t opcode;
+                int16_t pad;
+                int32_t nr;
+                int32_t nob;
+        }            hdr; /* struct mdmp without the data. */
+        struct iovec iov[3];
+        union vctrl  ctrl;
+        uint8_t      data[MAX_PAYLOAD]; /* The batch, copied out of the table. */
+        struct dent  ent[0];
+};
+
+SASSERT(sizeof ((struct dump *)0)->hdr == offsetof(struct mdmp, data));
+
+/* Values of the shadow words. */
+enum {
+        SHADOW_ABSENT  = 0, /* The slot is absent. */
+        /* Present, or being changed: ask escrowd. Other values are shadow_print()-s. */
+        SHADOW_UNKNOWN = 1
+};
+
+#define SHADOW_STALE (~0ull)     /* shadow::seen: the words are being re-read. */
+#define SHADOW_OFF   (~0ull - 1) /* shadow::seen: the shadow is given up. */
+
+/*
+ * ESCROW_SHADOW: what the session knows of the slots, a word per slot. The
+ * words are re-read with escrow_manifest() when the mirror (see @mirror)
+ * changes, which only tells that the slots are present, and are updated by the
+ * requests of the session: shadow_begin() marks the slot as changing before the
+ * request, shadow_end() records the outcome, unless the slot was marked again
+ * meanwhile. escrow_add() of a slot present with the same shadow_print() is
+ * skipped, escrow_get() of a slot known to be absent fails right away.
+ *
+ * Lookups take no locks: the words are accessed atomically and shadow::seen
+ * works as a sequence lock, only a reader that saw the same mirror::gen in it
+ * before and after reading a word uses the word. Leaves are allocated with
+ * compare-and-swap and freed in escrow_fini().
+ */
+struct shadow {
+        struct mirror *mirror;  /* Mapped read-only. */
+        int32_t        nob;     /* Of the mapping. */
+        int32_t        nr_tags;
+        /* The mirror::gen the words are valid for, or SHADOW_STALE, or SHADOW_OFF. */
+        uint64_t       seen;
+        bool           loading; /* A thread is in shadow_load(). */
+        void         **root[0]; /* Per tag: 1 << ROOT_SHIFT leaves of 1 << LEAF_SHIFT words. */
+};
+
+struct escrow {
+        struct stream        fd;
+        struct req          *queue;
+        pthread_mutex_t      lock;
+        pthread_mutex_t      wait;
+        /* ESCROW_DEDUP: hashes of the payloads escrowd has, direct-mapped. */
+        uint64_t             sent[DEDUP_NR];
+        /* ESCROW_PIDFD: 1 once escrowd accepted a remote slot, -1 if it refused. */
+        int                  remote;
+        /* Fetching descriptors from their owners was refused, escrowd fetches them. */
+        bool                 denied;
+        bool                 fenced; /* Escrowd sent an FNC, see escrow_fenced(). */
+        struct escrow_hooks  hooks;
+        struct escrow_hist  *hist; /* ESCROW_HIST: indexed by enum escrow_op. */
+        struct dump         *dump; /* See escrow_dump_init(). */
+        struct shadow       *shadow; /* ESCROW_SHADOW, NULL if escrowd cannot support it. */
+};
+
+static uint64_t op_now(void) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * Starts observing an operation, unless nobody observes the escrow. An
+ * operation started by another one in the same thread is a part of it.
+ */
+static void op_start(struct escrow *e, struct op *op, int32_t code, int16_t tag, int32_t idx) {
+        bool observed = e->hooks.start != NULL || e->hooks.end != NULL || e->hist != NULL;
+        op->e = observed && op_cur == NULL ? e : NULL;
+        if (op->e != NULL) {
+                op->info = (struct escrow_op_info){ .op    = code,
+                                                    .tag   = tag,
+                                                    .idx   = idx,
+                                                    .start = op_now() };
+                if (e->hooks.start != NULL) {
+                        e->hooks.start(e->hooks.arg, &op->info);
+                }
+                op_cur = op;
+        }
+}
+
+static void hist_add(int64_t *counter, int64_t val) {
+        __atomic_fetch_add(counter, val, __ATOMIC_RELAXED);
+}
+
+/* Completes an operation started by op_start(), returns RESULT. */
+static int op_end(struct op *op, int result) {
+        struct escrow *e = op->e;
+        if (e != NULL) {
+                op_cur = NULL;
+                op->info.end    = op_now();
+                op->info.result = result;
+                if (e->hist != NULL) {
+                        struct escrow_hist *h     = &e->hist[op->info.op];
+                        uint64_t            time  = op->info.end - op->info.start;
+                        int32_t             order = 63 - __builtin_clzll(time | 1);
+                        hist_add(&h->nr,       1);
+                        hist_add(&h->nr_err,   result != 0);
+                        hist_add(&h->time,     time);
+                        hist_add(&h->sent,     op->info.sent);
+                        hist_add(&h->recv,     op->info.recv);
+                        hist_add(&h->fds_sent, op->info.fds_sent);
+                        hist_add(&h->fds_recv, op->info.fds_recv);
+                        hist_add(&h->bucket[min_32(order, ESCROW_HIST_NR - 1)], 1);
+                }
+                if (e->hooks.end != NULL) {
+                        e->hooks.end(e->hooks.arg, &op->info);
+                }
+        }
+        return result;
+}
+
+static int32_t mt_cost(const struct msg *m) {
+        return msize(m) + (m->opcode == GET ? SOF(struct madd) : SOF(struct mrep));
+}
+
+static void mt_push(struct escrow *e, struct req *r) {
+        r->next = __atomic_load_n(&e->queue, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&e->queue, &r->next, r, true,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+                ;
+        }
+}
+
+/* Takes all queued requests in the submission order. */
+static struct req *mt_take(struct escrow *e) {
+        struct req *r    = __atomic_exchange_n(&e->queue, NULL, __ATOMIC_ACQUIRE);
+        struct req *fifo = NULL;
+        while (r != NULL) {
+                struct req *next = r->next;
+                r->next = fifo;
+                fifo = r;
+                r = next;
+        }
+        return fifo;
+}
+
+static void mt_done(struct escrow *e, struct req *r) {
+        pthread_mutex_lock(&e->wait);
+        r->done = true;
+        pthread_cond_signal(&r->cond);
+        pthread_mutex_unlock(&e->wait);
+}
+
+static void mt_drive(struct escrow *e) {
+        struct req *head = mt_take(e);
+        struct io   io[2 * WINDOW];
+        struct op  *own  = op_cur;
+        op_cur = NULL; /* Account the messages to the submitters' operations instead. */
+        /* Window bounds in-flight data, so that neither side blocks in sendmsg(). */
+        while (head != NULL) {
+                struct req *r;
+                struct req *next;
+                int32_t     nob = 0;
+                int32_t     nr  = 0;
+                for (r = head; r != NULL && nr < WINDOW &&
+                     (nr == 0 || nob + mt_cost(r->m) <= WINDOW_NOB); r = r->next) {
+                        io_send(&io[nr], r->m, msize(r->m), NULL, 0, r->in);
+                        nob += mt_cost(r->m);
+                        ++nr;
+                }
+                r = head;
+                /* Replies overwrite the requests. */
+                for (int32_t i = 0; i < nr; ++i, r = r->next) {
+                        io_recv(&io[nr + i], r->m, sizeof *r->m, r->out);
+                }
+                mcall(&e->fd, nr, io);
+                for (int32_t i = 0; i < nr; ++i, head = next) {
+                        next = head->next; /* Read before the request is released. */
+                        head->result = io[i].result ?: io[nr + i].result;
+                        if (head->result == 0 && head->op != NULL) {
+                                op_add(head->op, true, io[i].len, io[i].in >= 0);
+                                op_add(head->op, false, io[nr + i].len, *io[nr + i].fd >= 0);
+                        }
+                        mt_done(e, head);
+                }
+        }
+        op_cur = own;
+}
+
+static bool mt_queued(struct escrow *e) {
+        return __atomic_load_n(&e->queue, __ATOMIC_ACQUIRE) != NULL;
+}
+
+/* Drives all queued requests and releases the lock. */
+static void mt_release(struct escrow *e) {
+        do {
+                while (mt_queued(e)) {
+                        mt_drive(e);
+                }
+                pthread_mutex_unlock(&e->lock);
+                /*
+                 * Re-check the queue after releasing the lock: a thread that
+                 * pushed a request and failed to grab the lock meanwhile relies
+                 * on the lock holder to drive it.
+                 */
+        } while (mt_queued(e) && pthread_mutex_trylock(&e->lock) == 0);
+}
+
+static int mt_call(struct escrow *e, struct msg *m, int in, int *out) {
+        struct req r = { .m = m, .in = in, .out = out, .op = op_cur };
+        pthread_cond_init(&r.cond, NULL);
+        mt_push(e, &r);
+        if (pthread_mutex_trylock(&e->lock) == 0) {
+                mt_release(e);
+        } else {
+                pthread_mutex_lock(&e->wait);
+                while (!r.done) {
+                        pthread_cond_wait(&r.cond, &e->wait);
+                }
+                pthread_mutex_unlock(&e->wait);
+        }
+        pthread_cond_destroy(&r.cond);
+        return r.result;
+}
+
+/* Sends a request and receives the reply. */
+static int call(struct escrow *e, struct msg *m, int in, int *out) {
+        if (e->fd.flags & ESCROW_MT) {
+                return mt_call(e, m, in, out);
+        } else {
+                return msend(&e->fd, m, in) ?: mrecv(&e->fd, m, out);
+        }
+}
+
+static void excl_enter(struct escrow *e);
+static void excl_leave(struct escrow *e);
+
+/* Sends a QUIET request, escrowd does not reply (ESCROW_BEHIND). */
+static int post(struct escrow *e, struct msg *m, int in) {
+        int result;
+        m->opcode |= QUIET;
+        excl_enter(e);
+        result = msend(&e->fd, m, in);
+        excl_leave(e);
+        return result;
+}
+
+/* Gives the caller exclusive use of the connection, for multi-message exchanges. */
+static void excl_enter(struct escrow *e) {
+        if (e->fd.flags & ESCROW_MT) {
+                pthread_mutex_lock(&e->lock);
+        }
+}
+
+static void excl_leave(struct escrow *e) {
+        if (e->fd.flags & ESCROW_MT) {
+                mt_release(e);
+        }
+}
+
+/*
+ * Returns the result of a REP. An FNC, received in place of a reply, means
+ * that the session was fenced. As all requests of a fenced session fail with
+ * -ESTALE, it does not matter that the replies are off by one from then on.
+ */
+static int replied(struct escrow *e, const struct msg *m) {
+        if (m->opcode == FNC) {
+                __atomic_store_n(&e->fenced, true, __ATOMIC_RELAXED);
+                return -ESTALE;
+        } else if (m->opcode == REP) {
+                if (m->rep.rc != 0) {
+                        EV(e->fd.flags, OUT("Received from the escrowd: %i \"%s\"\n",
+                                            m->rep.rc, m->rep.data));
+                }
+                return m->rep.rc;
+        } else {
+                EV(e->fd.flags, OUT("Unexpected reply from escrowd: %i\n", m->opcode));
+                return -EPROTO;
+        }
+}
+
+/*
+ * Fetches the descriptor of a remote slot from its owner. On entry *FD is the
+ * pidfd of the owner, on a failure it is -1. Fails with -ESTALE if the owner
+ * has since reused the descriptor number for another file. Once fetching is
+ * refused, the following requests ask escrowd to fetch instead.
+ */
+static int pull(struct escrow *e, struct madd *m, int *fd) {
+        int pidfd = *fd;
+        m->opcode &= ~REMOTE;
+        *fd = pidfd >= 0 ? pid_getfd(pidfd, m->ufd) : -EPROTO;
+        if (pidfd >= 0) {
+                close(pidfd);
         }
-        if (strlen(path) >= sizeof(address.sun_path) - 1) {
-                EV(flags, warn("Path is too long: \"%s\"", path));
-                return ERROR(-EINVAL);
+        if (*fd >= 0 && file_id(*fd) != m->fid) {
+                close(*fd);
+                *fd = -ESTALE;
         }
-        if ((d->fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
-                EV(flags, warn("socket()"));
-                return ERROR(-errno);
+        if (*fd < 0) {
+                int result = *fd;
+                *fd = -1;
+                if (result == -EPERM) {
+                        __atomic_store_n(&e->denied, true, __ATOMIC_RELAXED);
+                }
+                return result;
         }
-        address.sun_family = AF_UNIX;
-        strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
-        mask = umask(0777 & ~(S_IRUSR | S_IWUSR)); /* rw------- */
-        result = bind(d->fd, (struct sockaddr *)&address, sizeof(address));
-        umask(mask);
-        if (result < 0) {
-                EV(flags, warn("bind()"));
-                return ERROR(-errno);
+        return 0;
+}
+
+SASSERT(sizeof(struct msg) == sizeof(struct madd));
+
+/*
+ * Asks escrowd to fetch the descriptor of a remote slot from its owner itself,
+ * when this process has no permission to. The caller has exclusive use of the
+ * connection. The reply overwrites M.
+ */
+static int refetch(struct escrow *e, struct madd *m, uint32_t flags, int *fd) {
+        struct mget req = { .opcode = GET, .tag = m->tag, .idx = m->idx,
+                            .flags = flags | GET_PULL };
+        return msend(&e->fd, (void *)&req, -1) ?: mrecv(&e->fd, (void *)m, fd);
+}
+
+/* Returns *SLOT, allocating it (NOB zeroed bytes) first if it is NULL and CREATE is set. */
+static void *shadow_alloc(void **slot, int32_t nob, bool create) {
+        void *cur = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+        void *mem;
+        if (cur == NULL && create && (mem = mem_alloc(nob)) != NULL) {
+                if (__atomic_compare_exchange_n(slot, &cur, mem, false,
+                                                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                        cur = mem;
+                } else { /* Another thread was faster. */
+                        mem_free(mem);
+                }
         }
-        if (listen(d->fd, QUEUE) < 0) {
-                EV(flags, warn("listen()"));
-                return ERROR(-errno);
+        return cur;
+}
+
+static bool shadow_has(const struct shadow *sh, int16_t tag, int32_t idx) {
+        return sh != NULL && 0 <= tag && tag < sh->nr_tags && 0 <= idx && idx < MAX_IDX;
+}
+
+/*
+ * Returns the word of the slot, NULL if it has none yet and CREATE is not set, or on a
+ * failure to allocate.
+ */
+static uint64_t *shadow_word(struct shadow *sh, int16_t tag, int32_t idx, bool create) {
+        void    **root = shadow_alloc((void **)&sh->root[tag], sizeof root[0] << ROOT_SHIFT,
+                                      create);
+        uint64_t *leaf = root == NULL ? NULL :
+                shadow_alloc(&root[idx >> LEAF_SHIFT], sizeof leaf[0] << LEAF_SHIFT, create);
+        return leaf != NULL ? &leaf[idx & MASK(LEAF_SHIFT)] : NULL;
+}
+
+/*
+ * The identity of a slot: the payload hash and the descriptor, its number and the file it
+ * refers to.
+ */
+static uint64_t shadow_print(int fd, uint64_t hash) {
+        uint64_t    key[4] = { hash, fd };
+        uint64_t    print;
+        struct stat st;
+        if (fd >= 0) {
+                if (fstat(fd, &st) != 0) {
+                        return SHADOW_UNKNOWN;
+                }
+                key[2] = st.st_dev;
+                key[3] = st.st_ino;
         }
-        EV(flags, OUT("Listening on \"%s\"\n", path));
-        d->tags = tags;
-        d->path = path;
-        d->nr_tags = nr_tags;
-        for (int32_t i = 0; i < nr_tags; ++i) {
-                seq_init(&d->tags[i].seq);
+        print = escrow_hash(key, sizeof key);
+        return print > SHADOW_UNKNOWN ? print : print + 2;
+}
+
+static int shadow_run(void *arg, const struct escrow_run *run) {
+        struct shadow *sh = arg;
+        for (int32_t i = 0; i < run->nr; ++i) {
+                if (shadow_has(sh, run->tag, run->idx + i)) {
+                        uint64_t *word = shadow_word(sh, run->tag, run->idx + i, true);
+                        if (word == NULL) {
+                                return -ENOMEM;
+                        }
+                        __atomic_store_n(word, SHADOW_UNKNOWN, __ATOMIC_RELAXED);
+                }
         }
-        *out = d;
         return 0;
 }
 
-void escrowd_fini(struct escrowd *d) {
-        for (int32_t i = 0; i < d->nr_tags; ++i) {
-                struct seq *s   = &d->tags[i].seq;
-                int32_t     max = seq_nr(s);
-                for (int32_t j = 0; j < max; ++j) {
-                        mem_free(seq_get(s, i));
+/* Re-reads the slots, unless another thread does. */
+static int shadow_load(struct escrow *e, struct shadow *sh) {
+        uint64_t seen = __atomic_load_n(&sh->seen, __ATOMIC_RELAXED);
+        uint64_t gen;
+        int      result;
+        if (seen == SHADOW_OFF || __atomic_exchange_n(&sh->loading, true, __ATOMIC_ACQUIRE)) {
+                return -EBUSY;
+        }
+        if (!__atomic_compare_exchange_n(&sh->seen, &seen, SHADOW_STALE, false,
+                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                __atomic_store_n(&sh->loading, false, __ATOMIC_RELEASE);
+                return -EBUSY;
+        }
+        /* Readers seeing the words below see SHADOW_STALE. */
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        /* Before the manifest: a change during it re-loads. */
+        gen = __atomic_load_n(&sh->mirror->gen, __ATOMIC_ACQUIRE);
+        for (int32_t t = 0; t < sh->nr_tags; ++t) {
+                void **root = __atomic_load_n(&sh->root[t], __ATOMIC_ACQUIRE);
+                for (int32_t rix = 0; root != NULL && rix < (1 << ROOT_SHIFT); ++rix) {
+                        uint64_t *leaf = __atomic_load_n(&root[rix], __ATOMIC_ACQUIRE);
+                        for (int32_t lix = 0; leaf != NULL && lix < (1 << LEAF_SHIFT); ++lix) {
+                                __atomic_store_n(&leaf[lix], SHADOW_ABSENT, __ATOMIC_RELAXED);
+                        }
                 }
-                seq_fini(&d->tags[i].seq);
         }
-        mem_free(d->tags);
-        close(d->stream.fd);
-        close(d->fd);
-        unlink(d->path);
+        result = escrow_manifest(e, &shadow_run, sh);
+        seen   = SHADOW_STALE;
+        if (!__atomic_compare_exchange_n(&sh->seen, &seen, result == 0 ? gen : SHADOW_OFF, false,
+                                         __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+                result = -EBUSY; /* Given up meanwhile. */
+        }
+        if (result != 0) {
+                EV(e->fd.flags, OUT("Shadow given up: %i.\n", result));
+        }
+        __atomic_store_n(&sh->loading, false, __ATOMIC_RELEASE);
+        return result;
 }
 
-int escrowd_loop(struct escrowd *d) {
-        struct msg  m   = {};
-        struct mrep rep = {};
-        int         fd;
-        int         result;
-        d->req = &m;
-        d->rep = &rep;
-        d->stream.fd = accept(d->fd, NULL, NULL);
-        if (d->stream.fd < 0) {
-                return -errno;
+/* Returns what the shadow knows of the slot: SHADOW_ABSENT, SHADOW_UNKNOWN or the identity. */
+static uint64_t shadow_peek(struct escrow *e, int16_t tag, int32_t idx) {
+        struct shadow *sh = e->shadow;
+        uint64_t      *word;
+        uint64_t       seen;
+        uint64_t       val;
+        if (!shadow_has(sh, tag, idx)) {
+                return SHADOW_UNKNOWN;
         }
-        while (true) {
-                fd = -1;
-                result = mrecv(&d->stream, &m, &fd);
-                if (result != 0) {
-                        break;
+        seen = __atomic_load_n(&sh->seen, __ATOMIC_ACQUIRE);
+        if (seen != __atomic_load_n(&sh->mirror->gen, __ATOMIC_ACQUIRE) &&
+            shadow_load(e, sh) == 0) {
+                seen = __atomic_load_n(&sh->seen, __ATOMIC_ACQUIRE);
+        }
+        if (seen != __atomic_load_n(&sh->mirror->gen, __ATOMIC_ACQUIRE)) {
+                return SHADOW_UNKNOWN;
+        }
+        word = shadow_word(sh, tag, idx, false);
+        val  = word != NULL ? __atomic_load_n(word, __ATOMIC_RELAXED) : SHADOW_ABSENT;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        return __atomic_load_n(&sh->seen, __ATOMIC_RELAXED) == seen ? val : SHADOW_UNKNOWN;
+}
+
+/* True if the slot is present with the identity PRINT: adding it again would change nothing. */
+static bool shadow_same(struct escrow *e, int16_t tag, int32_t idx, uint64_t print) {
+        /* Adding renews the lease. */
+        return print != SHADOW_UNKNOWN && shadow_peek(e, tag, idx) == print &&
+                __atomic_load_n(&e->shadow->mirror->ttl[tag], __ATOMIC_RELAXED) == 0;
+}
+
+/*
+ * Marks the slot as changing, before a request that changes it. Returns the word to pass to
+ * shadow_end().
+ */
+static uint64_t *shadow_begin(struct escrow *e, int16_t tag, int32_t idx) {
+        struct shadow *sh = e->shadow;
+        uint64_t      *word;
+        if (!shadow_has(sh, tag, idx)) { /* Escrowd rejects the request. */
+                return NULL;
+        }
+        word = shadow_word(sh, tag, idx, true);
+        if (word == NULL) { /* The change cannot be tracked. */
+                __atomic_store_n(&sh->seen, SHADOW_OFF, __ATOMIC_RELEASE);
+                return NULL;
+        }
+        __atomic_store_n(word, SHADOW_UNKNOWN, __ATOMIC_RELAXED);
+        return word;
+}
+
+/* Records the outcome of the request, VAL, unless the slot was marked or re-read meanwhile. */
+static void shadow_end(uint64_t *word, uint64_t val) {
+        uint64_t unknown = SHADOW_UNKNOWN;
+        if (word != NULL && !__atomic_compare_exchange_n(word, &unknown, val, false,
+                                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                __atomic_store_n(word, SHADOW_UNKNOWN, __ATOMIC_RELAXED);
+        }
+}
+
+/* Maps the mirror of escrowd. The slots are read by the first operation that needs them. */
+static void shadow_init(struct escrow *e) {
+        struct msg     m  = { .hel = { .opcode = HEL } };
+        struct shadow *sh = NULL;
+        int            fd = -1;
+        int            result = call(e, &m, -1, &fd);
+        if (result == 0 && m.opcode != HEL) {
+                result = replied(e, &m) ?: -EPROTO;
+        }
+        if (result == 0 && (fd < 0 || m.hel.nr_tags <= 0)) {
+                result = -EPROTO;
+        }
+#if defined(HAS_MIRROR)
+        if (result == 0) {
+                int32_t nob = offsetof(struct mirror, ttl) +
+                        m.hel.nr_tags * sizeof sh->mirror->ttl[0];
+                void   *map = mmap(NULL, nob, PROT_READ, MAP_SHARED, fd, 0);
+                sh = mem_alloc(offsetof(struct shadow, root) + m.hel.nr_tags * sizeof sh->root[0]);
+                if (map == MAP_FAILED || sh == NULL) {
+                        result = map == MAP_FAILED ? -errno : -ENOMEM;
+                        if (map != MAP_FAILED) {
+                                munmap(map, nob);
+                        }
+                        mem_free(sh);
+                } else {
+                        *sh = (struct shadow){ .mirror  = map,
+                                               .nob     = nob,
+                                               .nr_tags = m.hel.nr_tags,
+                                               .seen    = SHADOW_STALE };
+                        e->shadow = sh;
                 }
-                switch (m.opcode) {
-                case ADD:
-                        result = add(d, &m.add, fd);
-                        break;
-                case DEL:
-                        result = del(d, &m.del, fd);
-                        break;
-                case TAG:
-                        result = tag(d, &m.tag, fd);
-                        break;
-                case GET:
-                        result = get(d, &m.get, fd);
-                        break;
-                default:
-                        result = reply(d, -EPROTO, "Unexpected message type.");
+        }
+#else
+        result = result ?: -EOPNOTSUPP;
+#endif
+        if (fd >= 0) {
+                close(fd);
+        }
+        if (result != 0) {
+                EV(e->fd.flags, OUT("No shadow: %i.\n", result));
+        }
+}
+
+static void shadow_fini(struct shadow *sh) {
+        if (sh == NULL) {
+                return;
+        }
+        for (int32_t t = 0; t < sh->nr_tags; ++t) {
+                for (int32_t rix = 0; sh->root[t] != NULL && rix < (1 << ROOT_SHIFT); ++rix) {
+                        mem_free(sh->root[t][rix]);
                 }
-                if (result != 0) {
+                mem_free(sh->root[t]);
+        }
+#if defined(HAS_MIRROR)
+        munmap(sh->mirror, sh->nob);
+#endif
+        mem_free(sh);
+}
+
+/* Common part of escrow_get() and escrow_get_ready(). The reply is left in M. */
+static int get_slot(struct escrow *e, struct msg *m, int *fd, int32_t *nob, void *data) {
+        uint32_t  flags = m->get.flags;
+        struct op op;
+        int       result;
+        op_start(e, &op, ESCROW_OP_GET, m->get.tag, m->get.idx);
+        if (shadow_peek(e, m->get.tag, m->get.idx) == SHADOW_ABSENT) {
+                return op_end(&op, -ENOENT);
+        }
+        if (__atomic_load_n(&e->denied, __ATOMIC_RELAXED)) {
+                m->get.flags |= GET_PULL;
+        }
+        result = call(e, m, -1, fd);
+        if (result == 0 && m->opcode == (ADD | REMOTE) && pull(e, &m->add, fd) != 0) {
+                excl_enter(e);
+                result = refetch(e, &m->add, flags, fd);
+                excl_leave(e);
+        }
+        if (result == 0) {
+                if (m->opcode == ADD) {
+                        memcpy(data, m->add.data, min_32(*nob, m->add.nob));
+                        *nob = m->add.nob;
+                } else {
+                        result = replied(e, m);
+                }
+        }
+        return op_end(&op, result);
+}
+
+/*
+ * ESCROW_PIDFD: stores the number of the descriptor only, the descriptor stays
+ * here. Returns -EOPNOTSUPP if escrowd cannot do this.
+ */
+static int add_pidfd(struct escrow *e, struct msg *m, const void *data) {
+        int state = __atomic_load_n(&e->remote, __ATOMIC_RELAXED);
+        int dummy;
+        int result;
+        if (state < 0) {
+                return -EOPNOTSUPP;
+        }
+        m->opcode |= REMOTE;
+        m->add.fid = file_id(m->add.ufd);
+        memcpy(m->add.data, data, m->add.nob);
+        if (state > 0 && (e->fd.flags & ESCROW_BEHIND)) {
+                return post(e, m, -1);
+        }
+        result = call(e, m, -1, &dummy) ?: replied(e, m);
+        if (result == 0 || result == -EOPNOTSUPP) {
+                __atomic_store_n(&e->remote, result == 0 ? 1 : -1, __ATOMIC_RELAXED);
+        }
+        return result;
+}
+
+static int escrow_connect(struct escrow *e, const char *path, int32_t nr_tags) {
+        int result;
+        if ((e->fd.fd = socket(AF_UNIX, SOCK_TYPE, 0)) >= 0) {
+                struct sockaddr_un address;
+                address.sun_family = AF_UNIX;
+                strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+                if (connect(e->fd.fd, (void *)&address, sizeof address) >= 0) {
+                        EV(e->fd.flags, OUT("Connected to \"%s\"\n", path));
+                        return 0;
+                } else if (errno == ENOENT || errno == ECONNREFUSED || errno == ESHUTDOWN) {
+                        EV(e->fd.flags, OUT("Starting escrowd (%i).\n", errno));
+                        result = escrowd_fork(path, e->fd.flags, nr_tags);  /* Nobody is there. */
+                        if (result == 0) { /* Re-try. */
+                                result = -EAGAIN;
+                        }
+                } else {
+                        EV(e->fd.flags, warn("connect()"));
+                        result = -errno;
+                }
+                close(e->fd.fd);
+                e->fd.fd = -1;
+        } else {
+                EV(e->fd.flags, warn("socket()"));
+                result = -errno;
+        }
+        return result;
+}
+
+int escrow_init_hooks(const char *path, uint32_t flags, int32_t nr_tags,
+                      const struct escrow_hooks *hooks, struct escrow **escrow) {
+        struct escrow *e = mem_alloc(sizeof *e);
+        struct op      op;
+        int            result;
+        if (UNLIKELY(e == NULL)) {
+                return -ENOMEM;
+        }
+        if (path == NULL) {
+                path = getenv("ESCROW_PATH");
+        }
+        /* Fetch a descriptor from self: pidfd_open() and pidfd_getfd() are both needed. */
+        if (flags & ESCROW_PIDFD) {
+                int pidfd = pid_open(getpid());
+                int fd    = pidfd >= 0 ? pid_getfd(pidfd, pidfd) : -1;
+                if (fd >= 0) {
+                        close(fd);
+                } else { /* Fall back to passing the descriptors. */
+                        flags &= ~ESCROW_PIDFD;
+                }
+                if (pidfd >= 0) {
+                        close(pidfd);
+                }
+        }
+        if (hooks != NULL) {
+                e->hooks = *hooks;
+        }
+        if (flags & ESCROW_HIST) {
+                e->hist = mem_alloc(ESCROW_OP_NR * sizeof e->hist[0]);
+                if (UNLIKELY(e->hist == NULL)) {
+                        mem_free(e);
+                        return -ENOMEM;
+                }
+        }
+        e->fd.flags = flags;
+        if (flags & ESCROW_URING) {
+                e->fd.ring = ring_init();
+        }
+        pthread_mutex_init(&e->lock, NULL);
+        pthread_mutex_init(&e->wait, NULL);
+        op_start(e, &op, ESCROW_OP_INIT, -1, -1);
+        do {
+                result = escrow_connect(e, path, nr_tags);
+        } while (result == -EAGAIN);
+        if (result == 0 && (flags & ESCROW_SHADOW)) {
+                shadow_init(e);
+        }
+        op_end(&op, result);
+        if (result == 0) {
+                *escrow = e;
+        } else {
+                escrow_fini(e);
+        }
+        return result;
+}
+
+int escrow_init(const char *path, uint32_t flags, int32_t nr_tags, struct escrow **escrow) {
+        return escrow_init_hooks(path, flags, nr_tags, NULL, escrow);
+}
+
+void escrow_fini(struct escrow *escrow) {
+        if (escrow->fd.fd >= 0) {
+                close(escrow->fd.fd);
+        }
+        ring_fini(escrow->fd.ring);
+        pthread_mutex_destroy(&escrow->lock);
+        pthread_mutex_destroy(&escrow->wait);
+        mem_free(escrow->hist);
+        mem_free(escrow->dump);
+        shadow_fini(escrow->shadow);
+        mem_free(escrow);
+}
+
+int escrow_tag(struct escrow *escrow, int16_t tag, int32_t *nr, int32_t *nob) {
+        struct msg m = { .tag = { .opcode = TAG, .tag = tag } };
+        struct op  op;
+        int        dummy;
+        int        result;
+        op_start(escrow, &op, ESCROW_OP_TAG, tag, -1);
+        result = call(escrow, &m, -1, &dummy);
+        if (result == 0) {
+                if (m.opcode == INF) {
+                        *nr  = m.inf.nr;
+                        *nob = m.inf.total;
+                } else {
+                        result = replied(escrow, &m);
+                }
+        }
+        return op_end(&op, result);
+}
+
+int escrow_get(struct escrow *escrow, int16_t tag, int32_t idx, int *fd, int32_t *nob, void *data) {
+        struct msg m = { .get = { .opcode = GET, .tag = tag, .idx = idx } };
+        return get_slot(escrow, &m, fd, nob, data);
+}
+
+int escrow_set(struct escrow *escrow, int16_t tag, int16_t attr, int32_t val) {
+        struct msg m = { .set = { .opcode = SET, .tag = tag, .attr = attr, .val = val } };
+        struct op  op;
+        int        dummy;
+        op_start(escrow, &op, ESCROW_OP_SET, tag, -1);
+        return op_end(&op, call(escrow, &m, -1, &dummy) ?: replied(escrow, &m));
+}
+
+/* Passes a recovered slot to the callback, or closes its descriptor once the callback failed. */
+static void recovered(const struct madd *m, int fd, escrow_cb_t cb, void *arg, int *rc) {
+        struct escrow_slot slot = {
+                .tag     = m->tag,
+                .idx     = m->idx,
+                .fd      = fd,
+                .nob     = m->nob,
+                .data    = m->data,
+                .ready   = m->ready,
+                .pending = m->pending
+        };
+        if (*rc == 0) { /* Keep draining the stream after a failure. */
+                *rc = cb(arg, &slot);
+        } else if (fd >= 0) {
+                close(fd);
+        }
+}
+
+/* Remembers a remote slot whose descriptor escrow_recover() could not fetch. */
+static int late_add(struct mget **late, int32_t *nr, int32_t *cap, const struct madd *m) {
+        if (*nr == *cap) {
+                struct mget *grown = mem_alloc(max_32(2 * *cap, 16) * sizeof grown[0]);
+                if (grown == NULL) {
+                        return -ENOMEM;
+                }
+                memcpy(grown, *late, *nr * sizeof grown[0]);
+                mem_free(*late);
+                *late = grown;
+                *cap  = max_32(2 * *cap, 16);
+        }
+        (*late)[(*nr)++] = (struct mget){ .opcode = GET, .tag = m->tag, .idx = m->idx,
+                                          .flags = GET_READY };
+        return 0;
+}
+
+/*
+ * Delivers the slots remembered by late_add() once the stream is over, asking
+ * escrowd to fetch their descriptors. A slot escrowd cannot fetch either is
+ * delivered without the descriptor, as before.
+ */
+static int recover_late(struct escrow *e, int32_t nr, const struct mget *late, escrow_cb_t cb,
+                        void *arg, int *rc) {
+        struct msg m;
+        int        fd;
+        int        result = 0;
+        for (int32_t i = 0; i < nr && result == 0 && *rc == 0; ++i) {
+                m.add  = (struct madd){ .tag = late[i].tag, .idx = late[i].idx };
+                result = refetch(e, &m.add, late[i].flags, &fd);
+                if (result == 0 && m.opcode == FNC) {
+                        result = replied(e, &m);
+                } else if (result == 0 && m.opcode == REP) { /* Fetch the payload only. */
+                        result = msend(&e->fd, (void *)&late[i], -1) ?: mrecv(&e->fd, &m, &fd);
+                        if (result == 0 && m.opcode == (ADD | REMOTE)) {
+                                m.opcode = ADD;
+                                close(fd);
+                                fd = -1;
+                        }
+                }
+                if (result == 0 && m.opcode == ADD) {
+                        recovered(&m.add, fd, cb, arg, rc);
+                }
+        }
+        return result;
+}
+
+/*
+ * Remote slots whose descriptors cannot be fetched from their owners (no
+ * permission to ptrace(2) them) are delivered after the stream, fetched by
+ * escrowd. Once this happened, escrowd fetches them before streaming.
+ */
+int escrow_recover(struct escrow *escrow, int32_t *prio, escrow_cb_t cb, void *arg) {
+        struct msg   m    = { .rec = { .opcode = REC, .prio = *prio } };
+        struct mget *late = NULL;
+        int32_t      nr   = 0;
+        int32_t      cap  = 0;
+        struct op    op;
+        int          fd;
+        int          rc     = 0;
+        int          result;
+        op_start(escrow, &op, ESCROW_OP_RECOVER, -1, -1);
+        excl_enter(escrow);
+        if (__atomic_load_n(&escrow->denied, __ATOMIC_RELAXED)) {
+                m.rec.flags |= REC_PULL;
+        }
+        result = msend(&escrow->fd, &m, -1);
+        while (result == 0 && (result = mrecv(&escrow->fd, &m, &fd)) == 0) {
+                /* On a failure, the slot is delivered without the descriptor. */
+                if (m.opcode == (ADD | REMOTE)) {
+                        int r = pull(escrow, &m.add, &fd);
+                        if (r != 0 && r != -ESTALE && rc == 0 &&
+                            late_add(&late, &nr, &cap, &m.add) == 0) {
+                                continue;
+                        }
+                }
+                if (m.opcode == ADD) {
+                        recovered(&m.add, fd, cb, arg, &rc);
+                } else if (m.opcode == END) {
+                        *prio = m.end.prio + 1;
+                        result = recover_late(escrow, nr, late, cb, arg, &rc);
+                        break;
+                } else {
+                        result = replied(escrow, &m);
                         break;
                 }
         }
-        close(fd);
-        close(d->stream.fd);
+        excl_leave(escrow);
+        mem_free(late);
+        return op_end(&op, result ?: rc);
+}
+
+int escrow_get_ready(struct escrow *escrow, int16_t tag, int32_t idx, int *fd, int32_t *nob,
+                     void *data, uint32_t *ready, int32_t *pending) {
+        struct msg m = { .get = { .opcode = GET, .tag = tag, .idx = idx, .flags = GET_READY } };
+        int        result = get_slot(escrow, &m, fd, nob, data);
+        if (result == 0) {
+                *ready   = m.add.ready;
+                *pending = m.add.pending;
+        }
         return result;
 }
 
-int escrowd(const char *path, uint32_t flags, int32_t nr_tags) {
-        struct escrowd *d;
-        int             result = escrowd_init(&d, path, flags, nr_tags);
-        if (result != 0) {
-                errx(EXIT_FAILURE, "escrowd_init(): %i", result);
-        }
-        while (true) {
-                int result = escrowd_loop(d);
-                EV(flags, OUT("Session completed with %i.\n", result));
+static int add_ref(struct escrow *escrow, int16_t tag, int32_t idx, int fd, uint64_t hash) {
+        struct msg m = {
+                .ref = { .opcode = REF, .tag = tag, .idx = idx, .ufd = fd, .hash = hash }
+        };
+        int        dummy;
+        return call(escrow, &m, fd, &dummy) ?: replied(escrow, &m);
+}
+
+int escrow_add_ref(struct escrow *escrow, int16_t tag, int32_t idx, int fd, uint64_t hash) {
+        struct op  op;
+        uint64_t   print = escrow->shadow != NULL ? shadow_print(fd, hash) : SHADOW_UNKNOWN;
+        uint64_t  *word;
+        int        result;
+        op_start(escrow, &op, ESCROW_OP_ADD_REF, tag, idx);
+        if (shadow_same(escrow, tag, idx, print)) {
+                return op_end(&op, 0);
         }
-        escrowd_fini(d);
-        return 0;
+        word   = shadow_begin(escrow, tag, idx);
+        result = add_ref(escrow, tag, idx, fd, hash);
+        shadow_end(word, result == 0 ? print : SHADOW_UNKNOWN);
+        return op_end(&op, result);
 }
 
-int escrowd_fork(const char *path, uint32_t flags, int32_t nr_tags) {
-        static const char escrowd_name[] = "escrowd";
-        int result = fork();
-        if (result == 0) {
-                result = daemon(true, true) ?:
-#if defined(__linux__)
-                         prctl(PR_SET_NAME, escrowd_name, 0, 0, 0)
-#elif defined(__APPLE__)
-                         (setprogname(escrowd_name), 0)
-#else
-                         0
-#endif
-                         ;
-                if (result == 0) {
-                        result = escrowd(path, flags, nr_tags);
-                } else {
-                        result = -errno;
+static int add_slot(struct escrow *escrow, int16_t tag, int32_t idx, int fd, int32_t nob,
+                    void *data) {
+        struct msg m = { .add = { .opcode = ADD, .tag = tag, .idx = idx, .ufd = fd, .nob = nob } };
+        int        dummy;
+        uint64_t   hash = 0;
+        uint64_t  *sent = NULL;
+        int        result;
+        ASSERT(nob <= ARRAY_SIZE(m.add.data));
+        if ((escrow->fd.flags & ESCROW_PIDFD) && fd >= 0) {
+                result = add_pidfd(escrow, &m, data);
+                if (result != -EOPNOTSUPP) {
+                        return result;
                 }
-        } else if (result > 0) {
-                sleep(FORK_DELAY);
-                result = 0;
+                m.add = (struct madd){ .opcode = ADD, .tag = tag, .idx = idx, .ufd = fd,
+                                       .nob = nob };
+        }
+        /* REF needs the reply to fall back to ADD, so send the payload. */
+        if (escrow->fd.flags & ESCROW_BEHIND) {
+                memcpy(m.add.data, data, nob);
+                return post(escrow, &m, fd);
+        }
+        /* Relaxed: a stale entry costs an ADD at most. */
+        if ((escrow->fd.flags & ESCROW_DEDUP) && nob >= DEDUP_MIN) {
+                hash = escrow_hash(data, nob);
+                sent = &escrow->sent[hash & (DEDUP_NR - 1)];
+                if (__atomic_load_n(sent, __ATOMIC_RELAXED) == hash) {
+                        result = add_ref(escrow, tag, idx, fd, hash);
+                        if (result != -ENOENT) {
+                                return result;
+                        }
+                }
+        }
+        memcpy(m.add.data, data, nob);
+        result = call(escrow, &m, fd, &dummy) ?: replied(escrow, &m);
+        if (result == 0 && sent != NULL) {
+                __atomic_store_n(sent, hash, __ATOMIC_RELAXED);
         }
         return result;
 }
 
-/* @seq  */
+int escrow_add(struct escrow *escrow, int16_t tag, int32_t idx, int fd, int32_t nob, void *data) {
+        struct op  op;
+        uint64_t   print = escrow->shadow == NULL ? SHADOW_UNKNOWN :
+                shadow_print(fd, escrow_hash(data, nob));
+        uint64_t  *word;
+        int        result;
+        op_start(escrow, &op, ESCROW_OP_ADD, tag, idx);
+        if (shadow_same(escrow, tag, idx, print)) { /* A checkpoint of an unchanged slot. */
+                return op_end(&op, 0);
+        }
+        word   = shadow_begin(escrow, tag, idx);
+        result = add_slot(escrow, tag, idx, fd, nob, data);
+        shadow_end(word, result == 0 ? print : SHADOW_UNKNOWN);
+        return op_end(&op, result);
+}
 
-static void seq_init(struct seq *s) {
-        ASSERT(IS0(s));
+int escrow_takeover(struct escrow *escrow) {
+        struct msg m = { .tag = { .opcode = TKO } };
+        struct op  op;
+        int        dummy;
+        op_start(escrow, &op, ESCROW_OP_TAKEOVER, -1, -1);
+        return op_end(&op, call(escrow, &m, -1, &dummy) ?: replied(escrow, &m));
 }
 
-static void seq_fini(struct seq *s) {
-        for (int32_t i = 0; i < ARRAY_SIZE(s->root); ++i) {
-                mem_free(s->root[i]);
+int escrow_fenced(struct escrow *escrow) {
+        int16_t head[FRAMED ? 3 : 1]; /* The opcode, past the frame length, if any. */
+        ssize_t got;
+        int     result = 0;
+        if (__atomic_load_n(&escrow->fenced, __ATOMIC_RELAXED)) {
+                return 1;
         }
+        excl_enter(escrow); /* Nothing is in flight, an FNC can only be the next message. */
+        got = recv(escrow->fd.fd, head, sizeof head, MSG_PEEK | MSG_DONTWAIT);
+        if (got < 0) {
+                result = errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -errno;
+        } else if (got == 0) {
+                result = -ESHUTDOWN;
+        } else if (got == sizeof head && head[ARRAY_SIZE(head) - 1] == FNC) {
+                struct msg m;
+                int        fd;
+                result = mrecv(&escrow->fd, &m, &fd) ?: replied(escrow, &m) == -ESTALE;
+        }
+        excl_leave(escrow);
+        return result;
 }
 
-static int seq_add(struct seq *s, int32_t idx, void *val) {
-        int32_t rix = idx >> LEAF_SHIFT;
-        ASSERT(idx < MAX_IDX);
-        if (UNLIKELY(s->root[rix] == NULL)) {
-                s->root[rix] = mem_alloc(sizeof(uint64_t) << LEAF_SHIFT);
-                if (UNLIKELY(s->root[rix] == NULL)) {
-                        return ERROR(-ENOMEM);
+int escrow_stats(struct escrow *escrow, struct escrow_stats *stats) {
+        struct msg m = { .sta = { .opcode = STA } };
+        struct op  op;
+        int        dummy;
+        int        result;
+        op_start(escrow, &op, ESCROW_OP_STATS, -1, -1);
+        result = call(escrow, &m, -1, &dummy);
+        if (result == 0) {
+                if (m.opcode == STS) {
+                        *stats = m.sta.stats;
+                } else {
+                        result = replied(escrow, &m);
                 }
         }
-        s->root[rix][idx & MASK(LEAF_SHIFT)] = val;
-        return 0;
+        return op_end(&op, result);
 }
 
-static void seq_del(struct seq *s, int32_t idx) {
-        int32_t rix = idx >> LEAF_SHIFT;
-        ASSERT(idx < MAX_IDX);
-        if (LIKELY(s->root[rix] != NULL)) {
-                s->root[rix][idx & MASK(LEAF_SHIFT)] = 0;
+int escrow_addv(struct escrow *escrow, int32_t nr, const struct escrow_slot *slots) {
+        struct mslot hdr[WINDOW];
+        struct mrep  rep[WINDOW];
+        int          fd[WINDOW];
+        struct io    io[2 * WINDOW];
+        uint64_t    *word[WINDOW];
+        uint64_t     print[WINDOW];
+        struct op    op;
+        int          result = 0;
+        /* ESCROW_PIDFD: once escrowd is known to accept remote slots. */
+        bool         remote = (escrow->fd.flags & ESCROW_PIDFD) &&
+                              __atomic_load_n(&escrow->remote, __ATOMIC_RELAXED) > 0;
+        op_start(escrow, &op, ESCROW_OP_ADDV, -1, -1);
+        excl_enter(escrow);
+        for (int32_t i = 0; i < nr; i += WINDOW) {
+                int32_t n = min_32(nr - i, WINDOW);
+                for (int32_t j = 0; j < n; ++j) {
+                        const struct escrow_slot *s = &slots[i + j];
+                        bool                      r = remote && s->fd >= 0;
+                        ASSERT(0 <= s->nob && s->nob <= MAX_PAYLOAD);
+                        hdr[j] = (struct mslot){ .opcode = r ? ADD | REMOTE : ADD,
+                                                 .tag = s->tag, .idx = s->idx, .ufd = s->fd,
+                                                 .nob = s->nob, .fid = r ? file_id(s->fd) : 0 };
+                        io_send(&io[j], &hdr[j], sizeof hdr[j], s->data, s->nob, r ? -1 : s->fd);
+                        io_recv(&io[n + j], &rep[j], sizeof rep[j], &fd[j]);
+                        print[j] = escrow->shadow == NULL ? SHADOW_UNKNOWN :
+                                shadow_print(s->fd, escrow_hash(s->data, s->nob));
+                        word[j]  = shadow_begin(escrow, s->tag, s->idx);
+                }
+                mcall(&escrow->fd, n, io);
+                for (int32_t j = 0; j < n; ++j) {
+                        int rc = io[j].result ?: io[n + j].result ?:
+                                 replied(escrow, (void *)&rep[j]);
+                        shadow_end(word[j], rc == 0 ? print[j] : SHADOW_UNKNOWN);
+                        result = result ?: rc;
+                }
         }
+        excl_leave(escrow);
+        return op_end(&op, result);
 }
 
-static void *seq_get(const struct seq *s, int32_t idx) {
-        int32_t rix = idx >> LEAF_SHIFT;
-        ASSERT(idx < MAX_IDX);
-        if (LIKELY(s->root[rix] != NULL)) {
-                return s->root[rix][idx & MASK(LEAF_SHIFT)];
-        } else {
-                return NULL;
+int escrow_getv(struct escrow *escrow, int32_t nr, const struct escrow_slot *keys, escrow_cb_t cb,
+                void *arg) {
+        struct mget  req[WINDOW];
+        struct madd *rep = mem_alloc(WINDOW * sizeof rep[0]);
+        int          fd[WINDOW];
+        struct io    io[2 * WINDOW];
+        struct op    op;
+        int          rc     = 0;
+        int          result = 0;
+        if (rep == NULL) {
+                return -ENOMEM;
+        }
+        op_start(escrow, &op, ESCROW_OP_GETV, -1, -1);
+        excl_enter(escrow);
+        for (int32_t i = 0; i < nr; i += WINDOW) {
+                int32_t  n     = min_32(nr - i, WINDOW);
+                uint32_t flags = __atomic_load_n(&escrow->denied, __ATOMIC_RELAXED) ? GET_PULL : 0;
+                for (int32_t j = 0; j < n; ++j) {
+                        req[j] = (struct mget){ .opcode = GET, .tag = keys[i + j].tag,
+                                                .idx = keys[i + j].idx, .flags = flags };
+                        io_send(&io[j], &req[j], sizeof req[j], NULL, 0, -1);
+                        io_recv(&io[n + j], &rep[j], sizeof rep[j], &fd[j]);
+                }
+                mcall(&escrow->fd, n, io);
+                for (int32_t j = 0; j < n; ++j) {
+                        int r = io[j].result ?: io[n + j].result;
+                        if (r == 0 && rep[j].opcode == (ADD | REMOTE) &&
+                            pull(escrow, &rep[j], &fd[j]) != 0) {
+                                /* The window is complete, nothing is in flight. */
+                                r = refetch(escrow, &rep[j], 0, &fd[j]);
+                        }
+                        if (r == 0 && rep[j].opcode == ADD) {
+                                struct escrow_slot slot = {
+                                        .tag  = rep[j].tag,
+                                        .idx  = rep[j].idx,
+                                        .fd   = fd[j],
+                                        .nob  = rep[j].nob,
+                                        .data = rep[j].data
+                                };
+                                /* As in escrow_recover(), close the rest after a failure. */
+                                if (rc == 0) {
+                                        rc = cb(arg, &slot);
+                                } else if (fd[j] >= 0) {
+                                        close(fd[j]);
+                                }
+                        } else if (r == 0) {
+                                r = replied(escrow, (void *)&rep[j]);
+                        }
+                        result = result ?: r;
+                }
         }
+        excl_leave(escrow);
+        mem_free(rep);
+        return op_end(&op, rc ?: result);
 }
 
-static int32_t seq_nr(const struct seq *s) {
-        for (int32_t rix = ARRAY_SIZE(s->root) - 1; rix >= 0; --rix) {
-                if (s->root[rix] != NULL) {
-                        for (int32_t lix = (1 << LEAF_SHIFT) - 1; lix >= 0; --lix) {
-                                if (s->root[rix][lix] != 0) {
-                                        return (rix << ROOT_SHIFT) + lix + 1;
+int escrow_manifest(struct escrow *escrow, escrow_run_cb_t cb, void *arg) {
+        struct msg m = { .man = { .opcode = MAN } };
+        struct op  op;
+        int        fd;
+        int        rc     = 0;
+        int        result;
+        op_start(escrow, &op, ESCROW_OP_MANIFEST, -1, -1);
+        excl_enter(escrow);
+        result = msend(&escrow->fd, &m, -1);
+        while (result == 0 && (result = mrecv(&escrow->fd, &m, &fd)) == 0) {
+                if (m.opcode == RUN) {
+                        for (int32_t off = 0; rc == 0 && off + SOF(struct mrun) <= m.man.nob;) {
+                                struct mrun       hdr;
+                                struct escrow_run run;
+                                memcpy(&hdr, m.man.data + off, sizeof hdr);
+                                off += sizeof hdr;
+                                if (off + hdr.nr * SOF(uint16_t) > m.man.nob) {
+                                        rc = -EPROTO;
+                                        break;
                                 }
+                                run = (struct escrow_run){ .tag   = hdr.tag,
+                                                           .flags = hdr.flags,
+                                                           .idx   = hdr.idx,
+                                                           .nr    = hdr.nr,
+                                                           .nob   = (void *)(m.man.data + off) };
+                                rc = cb(arg, &run);
+                                off += hdr.nr * sizeof(uint16_t);
                         }
+                } else if (m.opcode == END) {
+                        break;
+                } else {
+                        result = replied(escrow, &m);
+                        break;
                 }
         }
-        return 0;
+        excl_leave(escrow);
+        return op_end(&op, result ?: rc);
 }
 
-union ctrl {
-        char           buf[CMSG_SPACE(sizeof (int))];
-        struct cmsghdr hdr;
-};
+int escrow_watch(struct escrow *escrow, int16_t tag, uint32_t flags, escrow_event_cb_t cb,
+                 void *arg) {
+        struct msg m = { .wch = { .opcode = WCH, .tag = tag, .flags = flags } };
+        struct op  op;
+        int        fd;
+        int        rc     = 0;
+        int        result;
+        op_start(escrow, &op, ESCROW_OP_WATCH, tag, -1);
+        excl_enter(escrow);
+        result = msend(&escrow->fd, &m, -1);
+        while (result == 0 && rc == 0 && (result = mrecv(&escrow->fd, &m, &fd)) == 0) {
+                if (fd >= 0) {
+                        close(fd);
+                }
+                if (m.opcode == EVT) {
+                        for (int32_t off = 0; rc == 0 && off + SOF(struct mev) <= m.evt.nob;) {
+                                struct mev          hdr;
+                                struct escrow_event ev;
+                                memcpy(&hdr, m.evt.data + off, sizeof hdr);
+                                off += sizeof hdr;
+                                if (hdr.nob < 0 || hdr.nob > MAX_PAYLOAD) {
+                                        rc = -EPROTO;
+                                        break;
+                                }
+                                ev = (struct escrow_event){ .type  = hdr.type,
+                                                            .tag   = hdr.tag,
+                                                            .idx   = hdr.idx,
+                                                            .flags = hdr.flags,
+                                                            .nob   = hdr.nob };
+                                if (flags & ESCROW_WATCH_DATA && hdr.type != ESCROW_EV_DEL) {
+                                        if (off + hdr.nob > m.evt.nob) {
+                                                rc = -EPROTO;
+                                                break;
+                                        }
+                                        ev.data = m.evt.data + off;
+                                        off += hdr.nob;
+                                }
+                                rc = cb(arg, &ev);
+                        }
+                } else if (m.opcode == END) {
+                        struct escrow_event synced = { .type = ESCROW_EV_SYNCED,
+                                                       .tag  = -1,
+                                                       .idx  = -1 };
+                        rc = cb(arg, &synced);
+                } else {
+                        result = replied(escrow, &m) ?: -EPROTO;
+                }
+        }
+        excl_leave(escrow);
+        return op_end(&op, result ?: rc);
+}
 
-static int send_fd(int socket, int32_t nob, const void *data, int fd) {
-        struct iovec    iov;
-        struct msghdr   msgh;
-        union ctrl      cmsg;
-        msgh.msg_name    = NULL;
-        msgh.msg_namelen = 0;
-        msgh.msg_iov     = &iov;
-        msgh.msg_iovlen  = 1;
-        iov.iov_base     = (void *)data;
-        iov.iov_len      = nob;
-        if (fd >= 0) {
-                struct cmsghdr *cmsgp;
-                msgh.msg_control    = cmsg.buf;
-                msgh.msg_controllen = sizeof cmsg.buf;
-                cmsgp = CMSG_FIRSTHDR(&msgh);
-                cmsgp->cmsg_level = SOL_SOCKET;
-                cmsgp->cmsg_type  = SCM_RIGHTS;
-                cmsgp->cmsg_len   = CMSG_LEN(sizeof fd);
-                memcpy(CMSG_DATA(cmsgp), &fd, sizeof fd);
-        } else {
-                msgh.msg_control    = NULL;
-                msgh.msg_controllen = 0;
+int escrow_dump_init(struct escrow *escrow, int32_t nr) {
+        struct dump *dump;
+        if (nr < 0 || escrow->dump != NULL) {
+                return -EINVAL;
         }
-        if (sendmsg(socket, &msgh, 0) == -1) {
-                return -errno;
+        dump = mem_alloc(sizeof *dump + nr * sizeof dump->ent[0]);
+        if (UNLIKELY(dump == NULL)) {
+                return -ENOMEM;
         }
+        dump->nr = nr;
+        for (int32_t i = 0; i < nr; ++i) {
+                dump->ent[i].rec.tag = -1;
+        }
+        escrow->dump = dump;
         return 0;
 }
 
-static int recv_fd(int socket, int32_t nob, void *data, int *fd) {
-        ssize_t         nr;
-        struct iovec    iov;
-        struct msghdr   msgh;
-        union ctrl      cmsg;
-        struct cmsghdr *cmsgp;
-
-        *fd                 = -1;
-        msgh.msg_name       = NULL;
-        msgh.msg_namelen    = 0;
-        msgh.msg_iov        = &iov;
-        msgh.msg_iovlen     = 1;
-        iov.iov_base        = data;
-        iov.iov_len         = nob;
-        msgh.msg_control    = cmsg.buf;
-        msgh.msg_controllen = sizeof cmsg.buf;
-        nr = recvmsg(socket, &msgh, 0);
-        if (nr == -1) {
-                return -errno;
-        } else if (nr == 0) {
-                return -ESHUTDOWN;
+int escrow_dump_set(struct escrow *escrow, int32_t i, int16_t tag, int32_t idx, int fd, int32_t nob,
+                    const void *data) {
+        struct dent *e;
+        if (escrow->dump == NULL || i < 0 || i >= escrow->dump->nr ||
+            nob < 0 || nob > ESCROW_DUMP_MAX) {
+                return -EINVAL;
         }
-        cmsgp = CMSG_FIRSTHDR(&msgh);
-        if (cmsgp == NULL) {
-                return 0;
+        e = &escrow->dump->ent[i];
+        /*
+         * A dump interrupting the update must see the entry unused or complete. A dump in
+         * another thread is not allowed.
+         */
+        __atomic_store_n(&e->rec.tag, -1, __ATOMIC_RELEASE);
+        if (tag >= 0) {
+                e->rec.idx = idx;
+                e->rec.ufd = fd;
+                e->rec.nob = nob;
+                e->data    = data;
+                __atomic_store_n(&e->rec.tag, tag, __ATOMIC_RELEASE);
         }
-        if (cmsgp->cmsg_len != CMSG_LEN(sizeof *fd) ||
-            cmsgp->cmsg_level != SOL_SOCKET || cmsgp->cmsg_type != SCM_RIGHTS) {
-                return -EPROTO;
+        return 0;
+}
+
+/*
+ * Sends a DMP batch of NR records, NOB bytes in dump->data, with NFD descriptors already
+ * in the control buffer.
+ */
+static int dump_send(struct escrow *escrow, int32_t nr, int32_t nob, int32_t nfd) {
+        struct dump  *dump = escrow->dump;
+        struct msghdr hdr  = { .msg_iov    = &dump->iov[FRAMED ? 0 : 1],
+                               .msg_iovlen = FRAMED ? 3 : 2 };
+        dump->hdr    = (typeof(dump->hdr)){ .opcode = DMP | QUIET, .nr = nr, .nob = nob };
+        dump->len    = sizeof dump->hdr + nob;
+        dump->iov[0] = (struct iovec){ &dump->len, sizeof dump->len };
+        dump->iov[1] = (struct iovec){ &dump->hdr, sizeof dump->hdr };
+        dump->iov[2] = (struct iovec){ dump->data, nob };
+        if (nfd > 0) {
+                hdr.msg_control          = dump->ctrl.buf;
+                hdr.msg_controllen       = CMSG_SPACE(nfd * sizeof(int));
+                dump->ctrl.hdr.cmsg_level = SOL_SOCKET;
+                dump->ctrl.hdr.cmsg_type  = SCM_RIGHTS;
+                dump->ctrl.hdr.cmsg_len   = CMSG_LEN(nfd * sizeof(int));
+        }
+        while (sendmsg(escrow->fd.fd, &hdr, 0) == -1) {
+                if (errno != EINTR) {
+                        return -errno;
+                }
         }
-        memcpy(fd, CMSG_DATA(cmsgp), sizeof *fd);
         return 0;
 }
 
-static void *mem_alloc(int32_t size) {
-        return calloc(1, size);
+/*
+ * Async-signal-safe: only memcpy() and sendmsg(), on preallocated buffers. No
+ * locks are taken: with SOCK_SEQPACKET a batch cannot split a message of a
+ * thread interrupted by the signal, and escrowd does not reply to it. Each
+ * accepted entry is copied into dump->data before it is looked at, so that the
+ * batch is consistent even if escrow_dump_set() in an interrupted frame is
+ * half-way through the entry.
+ */
+int escrow_dump(struct escrow *escrow) {
+        struct dump *dump   = escrow->dump;
+        int          saved  = errno;
+        int          result = 0;
+        if (dump == NULL) {
+                return -EINVAL;
+        }
+        for (int32_t i = 0; i < dump->nr && result == 0;) {
+                int32_t nr  = 0;
+                int32_t nob = 0;
+                int32_t nfd = 0;
+                for (; i < dump->nr && nr < VEC_MAX; ++i) {
+                        struct dent *e = &dump->ent[i];
+                        struct mdrec rec;
+                        const void  *data;
+                        if (__atomic_load_n(&e->rec.tag, __ATOMIC_ACQUIRE) < 0) {
+                                continue;
+                        }
+                        rec  = e->rec;
+                        data = e->data;
+                        /* Changed under us. */
+                        if (rec.tag < 0 || rec.nob < 0 || rec.nob > ESCROW_DUMP_MAX) {
+                                continue;
+                        }
+                        if (nob + SOF(rec) + rec.nob > MAX_PAYLOAD) {
+                                break;
+                        }
+                        memcpy(&dump->data[nob], &rec, sizeof rec);
+                        memcpy(&dump->data[nob + sizeof rec], data, rec.nob);
+                        if (rec.ufd >= 0) {
+                                ((int *)CMSG_DATA(&dump->ctrl.hdr))[nfd++] = rec.ufd;
+                        }
+                        nob += sizeof rec + rec.nob;
+                        ++nr;
+                }
+                if (nr > 0) {
+                        result = dump_send(escrow, nr, nob, nfd);
+                }
+        }
+        errno = saved;
+        return result;
 }
 
-static void mem_free(void *mem) {
-        free(mem);
+/* Receives the reply to the oldest request in flight, the first failure goes to *RC. */
+static int reply_collect(struct escrow *e, int *rc) {
+        struct msg m;
+        int        fd;
+        int        result = mrecv(&e->fd, &m, &fd);
+        if (result == 0 && fd >= 0) {
+                close(fd);
+        }
+        if (result == 0 && *rc == 0) {
+                *rc = replied(e, &m);
+        }
+        return result;
 }
 
-/* @client */
+/*
+ * Up to WINDOW VEC requests are in flight, their replies are checked, so that
+ * the failures of the caller's write-behind requests stay for escrow_sync().
+ * CLR then deletes the slots past the saved ones, left from a larger set.
+ */
+int escrow_epoll_savev(struct escrow *escrow, int16_t tag, int32_t nr,
+                       const struct escrow_reg *regs) {
+        struct mvec m;
+        struct mclr clr = { .opcode = CLR, .tag = tag, .nr = 1, .range = { { nr, MAX_IDX } } };
+        struct op   op;
+        int         fd[VEC_MAX];
+        int32_t     sent   = 0; /* Requests waiting for replies. */
+        int         rc     = 0;
+        int         result = 0;
+        op_start(escrow, &op, ESCROW_OP_EPOLL_SAVE, tag, -1);
+        excl_enter(escrow);
+        for (int32_t i = 0; i < nr && result == 0; i += VEC_MAX) {
+                int32_t n = min_32(nr - i, VEC_MAX);
+                m = (struct mvec){ .opcode = VEC, .tag = tag, .idx = i, .nr = n };
+                memcpy(m.reg, &regs[i], n * sizeof regs[0]);
+                for (int32_t j = 0; j < n; ++j) {
+                        fd[j] = regs[i + j].fd;
+                        shadow_begin(escrow, tag, i + j); /* Left to escrowd. */
+                }
+                result = msendv(&escrow->fd, (void *)&m, n, fd);
+                if (result == 0 && ++sent == WINDOW) {
+                        result = reply_collect(escrow, &rc);
+                        --sent;
+                }
+        }
+        if (result == 0 && (result = msend(&escrow->fd, (void *)&clr, -1)) == 0) {
+                ++sent;
+        }
+        while (result == 0 && sent-- > 0) {
+                result = reply_collect(escrow, &rc);
+        }
+        excl_leave(escrow);
+        return op_end(&op, result ?: rc);
+}
 
-struct escrow {
-        struct stream fd;
-};
+#if defined(__linux__)
 
-static int replied(const struct escrow *e, const struct msg *m) {
-        if (m->opcode == REP) {
-                if (m->rep.rc != 0) {
-                        EV(e->fd.flags, OUT("Received from the escrowd: %i \"%s\"\n",
-                                            m->rep.rc, m->rep.data));
+static int epoll_scan(struct escrow *escrow, int16_t tag, int ep) {
+        char               path[64];
+        char               line[256];
+        struct escrow_reg *regs = NULL;
+        int32_t            nr   = 0;
+        int32_t            max  = 0;
+        int                result;
+        FILE              *info;
+        snprintf(path, sizeof path, "/proc/self/fdinfo/%i", ep);
+        info = fopen(path, "r");
+        if (info == NULL) {
+                return -errno;
+        }
+        /* "tfd: %8d events: %8x data: %16llx ..." */
+        while (fgets(line, sizeof line, info) != NULL) {
+                struct escrow_reg  reg;
+                unsigned long long data;
+                if (sscanf(line, "tfd: %d events: %x data: %llx",
+                           &reg.fd, &reg.events, &data) != 3) {
+                        continue;
                 }
-                return m->rep.rc;
-        } else {
-                EV(e->fd.flags, OUT("Unexpected reply from escrowd: %i\n", m->opcode));
-                return -EPROTO;
+                reg.data = data;
+                if (nr == max) {
+                        struct escrow_reg *more = mem_alloc((max = 2 * max + 64) * sizeof regs[0]);
+                        if (more == NULL) {
+                                mem_free(regs);
+                                fclose(info);
+                                return -ENOMEM;
+                        }
+                        memcpy(more, regs, nr * sizeof regs[0]);
+                        mem_free(regs);
+                        regs = more;
+                }
+                regs[nr++] = reg;
         }
+        fclose(info);
+        result = escrow_epoll_savev(escrow, tag, nr, regs);
+        mem_free(regs);
+        return result;
 }
 
-static int escrow_init_try(const char *path, uint32_t flags, int32_t nr_tags, struct escrow **escrow) {
-        struct escrow *e = mem_alloc(sizeof *e);
-        int            result;
-        if (LIKELY(e != NULL)) {
-                if (path == NULL) {
-                        path = getenv("ESCROW_PATH");
-                }
-                e->fd.flags = flags;
-                if ((e->fd.fd = socket(AF_UNIX, SOCK_STREAM, 0)) >= 0) {
-                        struct sockaddr_un address;
-                        address.sun_family = AF_UNIX;
-                        strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
-                        if (connect(e->fd.fd, (void *)&address, sizeof address) >= 0) {
-                                EV(e->fd.flags, OUT("Connected to \"%s\"\n", path));
-                                *escrow = e;
-                                return 0;
-                        } else if (errno == ENOENT || errno == ECONNREFUSED || errno == ESHUTDOWN) {
-                                EV(e->fd.flags, OUT("Starting escrowd (%i).\n", errno));
-                                result = escrowd_fork(path, flags, nr_tags);  /* Nobody is there. */
-                                if (result == 0) { /* Re-try. */
-                                        result = -EAGAIN;
+int escrow_epoll_save(struct escrow *escrow, int16_t tag, int ep) {
+        struct op op;
+        op_start(escrow, &op, ESCROW_OP_EPOLL_SAVE, tag, -1);
+        return op_end(&op, epoll_scan(escrow, tag, ep));
+}
+
+int escrow_epoll_restore(struct escrow *escrow, int16_t tag, int *ep, int32_t *nr,
+                         struct escrow_reg *regs) {
+        struct msg m      = { .tag = { .opcode = VGT, .tag = tag } };
+        int        fd[VEC_MAX];
+        int32_t    n;
+        int32_t    got    = 0;
+        int        rc     = 0;
+        int        result;
+        struct op  op;
+        *ep = epoll_create1(EPOLL_CLOEXEC);
+        if (*ep < 0) {
+                return -errno;
+        }
+        op_start(escrow, &op, ESCROW_OP_EPOLL_RESTORE, tag, -1);
+        excl_enter(escrow);
+        result = msend(&escrow->fd, &m, -1);
+        while (result == 0 && (result = mrecvv(&escrow->fd, &m, &n, fd, 0)) == 0) {
+                if (m.opcode == VEC && n == m.vec.nr) {
+                        for (int32_t i = 0; i < n; ++i, ++got) {
+                                struct escrow_reg  *reg = &m.vec.reg[i];
+                                struct epoll_event  ev  = { .events   = reg->events,
+                                                            .data.u64 = reg->data };
+                                if (got >= *nr) { /* The caller would not know it. */
+                                        close(fd[i]);
+                                        rc = rc ?: -ENOSPC;
+                                        continue;
                                 }
-                        } else {
-                                EV(e->fd.flags, warn("connect()"));
-                                result = -errno;
-                        }
-                        if (result != 0) {
-                                close(e->fd.fd);
+                                if (epoll_ctl(*ep, EPOLL_CTL_ADD, fd[i], &ev) != 0 && rc == 0) {
+                                        rc = -errno;
+                                }
+                                regs[got] = (struct escrow_reg){ .fd     = fd[i],
+                                                                 .events = reg->events,
+                                                                 .data   = reg->data };
                         }
+                } else if (m.opcode == END) {
+                        break;
                 } else {
-                        EV(e->fd.flags, warn("socket()"));
-                        result = -errno;
-                }
-                if (result != 0) {
-                        mem_free(e);
+                        for (int32_t i = 0; i < n; ++i) {
+                                close(fd[i]);
+                        }
+                        result = m.opcode == VEC ? -EPROTO : replied(escrow, &m);
+                        break;
                 }
-        } else {
-                result = -ENOMEM;
         }
-        return result;
+        excl_leave(escrow);
+        *nr = got;
+        if ((result ?: rc) != 0) {
+                close(*ep);
+                *ep = -1;
+        }
+        return op_end(&op, result ?: rc);
 }
 
-int escrow_init(const char *path, uint32_t flags, int32_t nr_tags, struct escrow **escrow) {
-        int result;
-        do {
-                result = escrow_init_try(path, flags, nr_tags, escrow);
-        } while (result == -EAGAIN);
-        return result;
+#else
+
+int escrow_epoll_save(struct escrow *escrow, int16_t tag, int ep) {
+        return -ENOSYS;
 }
 
-void escrow_fini(struct escrow *escrow) {
-        close(escrow->fd.fd);
-        mem_free(escrow);
+int escrow_epoll_restore(struct escrow *escrow, int16_t tag, int *ep, int32_t *nr,
+                         struct escrow_reg *regs) {
+        return -ENOSYS;
 }
 
-int escrow_tag(struct escrow *escrow, int16_t tag, int32_t *nr, int32_t *nob) {
-        struct msg m = { .tag = { .opcode = TAG, .tag = tag } };
+#endif
+
+int escrow_del(struct escrow *escrow, int16_t tag, int32_t idx) {
+        struct msg m = { .del = { .opcode = DEL, .tag = tag, .idx = idx } };
+        struct op  op;
+        uint64_t  *word;
         int        dummy;
-        int        result = msend(&escrow->fd, &m, -1) ?: mrecv(&escrow->fd, &m, &dummy);
-        if (result == 0) {
-                if (m.opcode == INF) {
-                        *nr  = m.inf.nr;
-                        *nob = m.inf.total;
-                } else {
-                        result = replied(escrow, &m);
+        int        result;
+        op_start(escrow, &op, ESCROW_OP_DEL, tag, idx);
+        word = shadow_begin(escrow, tag, idx);
+        if (escrow->fd.flags & ESCROW_BEHIND) {
+                result = post(escrow, &m, -1);
+        } else {
+                result = call(escrow, &m, -1, &dummy) ?: replied(escrow, &m);
+        }
+        shadow_end(word, result == 0 ? SHADOW_ABSENT : SHADOW_UNKNOWN);
+        return op_end(&op, result);
+}
+
+int escrow_lease(struct escrow *escrow, int16_t tag, int32_t idx, int32_t ttl) {
+        struct msg m = { .lse = { .opcode = LSE, .tag = tag, .idx = idx, .ttl = ttl } };
+        struct op  op;
+        int        dummy;
+        op_start(escrow, &op, ESCROW_OP_LEASE, tag, idx);
+        /* Adding the slot again cancels the lease: never skip that. */
+        shadow_begin(escrow, tag, idx);
+        if (escrow->fd.flags & ESCROW_BEHIND) {
+                return op_end(&op, post(escrow, &m, -1));
+        }
+        return op_end(&op, call(escrow, &m, -1, &dummy) ?: replied(escrow, &m));
+}
+
+int escrow_del_range(struct escrow *escrow, int16_t tag, int32_t idx, int32_t end) {
+        struct msg m = { .clr = { .opcode = CLR, .tag = tag, .nr = 1, .range = { { idx, end } } } };
+        struct op  op;
+        int        dummy;
+        op_start(escrow, &op, ESCROW_OP_DEL_RANGE, tag, idx);
+        return op_end(&op, call(escrow, &m, -1, &dummy) ?: replied(escrow, &m));
+}
+
+static int idx_cmp(const void *a, const void *b) {
+        int32_t x = *(const int32_t *)a;
+        int32_t y = *(const int32_t *)b;
+        return (x > y) - (x < y);
+}
+
+int escrow_clear_except(struct escrow *escrow, int16_t tag, int32_t nr, const int32_t *keep) {
+        struct msg  *m      = mem_alloc(sizeof *m);
+        int32_t     *sorted = mem_alloc((nr + 1) * sizeof sorted[0]);
+        int32_t      idx    = 0;
+        struct op    op;
+        int          dummy;
+        int          result = 0;
+        if (m == NULL || sorted == NULL) {
+                mem_free(m);
+                mem_free(sorted);
+                return -ENOMEM;
+        }
+        op_start(escrow, &op, ESCROW_OP_DEL_RANGE, tag, -1);
+        memcpy(sorted, keep, nr * sizeof sorted[0]);
+        qsort(sorted, nr, sizeof sorted[0], &idx_cmp);
+        sorted[nr] = INT32_MAX; /* Sentinel: the last range extends to the end. */
+        excl_enter(escrow); /* Other threads' requests cannot interleave with the CLR messages. */
+        /* Delete the gaps between the kept indices. */
+        for (int32_t i = 0; i <= nr && result == 0; ++i) {
+                if (sorted[i] > idx) {
+                        m->clr.range[m->clr.nr].idx   = idx;
+                        m->clr.range[m->clr.nr++].end = sorted[i];
+                }
+                idx = max_32(idx, sorted[i] + (sorted[i] < INT32_MAX));
+                if (m->clr.nr == CLR_MAX || (i == nr && m->clr.nr > 0)) {
+                        m->clr.opcode = CLR;
+                        m->clr.tag    = tag;
+                        result = msend(&escrow->fd, m, -1) ?: mrecv(&escrow->fd, m, &dummy) ?:
+                                 replied(escrow, m);
+                        m->clr.nr = 0; /* The reply overwrote the message. */
                 }
         }
-        return result;
+        excl_leave(escrow);
+        mem_free(sorted);
+        mem_free(m);
+        return op_end(&op, result);
 }
 
-int escrow_get(struct escrow *escrow, int16_t tag, int32_t idx, int *fd, int32_t *nob, void *data) {
-        struct msg m = { .get = { .opcode = GET, .tag = tag, .idx = idx } };
-        int        result = msend(&escrow->fd, &m, -1) ?: mrecv(&escrow->fd, &m, fd);
+int escrow_sync(struct escrow *escrow, int32_t *nr, struct escrow_error *errors) {
+        struct msg m = { .err = { .opcode = SYN } };
+        struct op  op;
+        int        dummy;
+        int        result;
+        op_start(escrow, &op, ESCROW_OP_SYNC, -1, -1);
+        result = call(escrow, &m, -1, &dummy);
         if (result == 0) {
-                if (m.opcode == ADD) {
-                        memcpy(data, m.add.data, min_32(*nob, m.add.nob));
-                        *nob = m.add.nob;
+                if (m.opcode == ERR) {
+                        int32_t n = min_32(min_32(m.err.nr, ERRORS), nr != NULL ? *nr : 0);
+                        memcpy(errors, m.err.err, n * sizeof errors[0]);
+                        result = m.err.nr > 0 ? m.err.err[0].rc : 0;
+                        if (nr != NULL) {
+                                *nr = m.err.nr;
+                        }
                 } else {
                         result = replied(escrow, &m);
                 }
         }
-        return result;
+        return op_end(&op, result);
 }
 
-int escrow_add(struct escrow *escrow, int16_t tag, int32_t idx, int fd, int32_t nob, void *data) {
-        struct msg m = { .add = { .opcode = ADD, .tag = tag, .idx = idx, .ufd = fd, .nob = nob } };
-        int        dummy;
-        ASSERT(nob <= ARRAY_SIZE(m.add.data));
-        memcpy(m.add.data, data, nob);
-        return msend(&escrow->fd, &m, fd) ?: mrecv(&escrow->fd, &m, &dummy) ?: replied(escrow, &m);
+int escrow_hist(struct escrow *escrow, int32_t op, struct escrow_hist *hist) {
+        int64_t *dst = (int64_t *)hist;
+        SASSERT(sizeof *hist % sizeof *dst == 0);
+        if (escrow->hist == NULL) {
+                return -EOPNOTSUPP;
+        } else if (!(0 <= op && op < ESCROW_OP_NR)) {
+                return -EINVAL;
+        }
+        /* Other threads can be updating the counters. */
+        for (int32_t i = 0; i < SOF(*hist) / SOF(*dst); ++i) {
+                dst[i] = __atomic_load_n((int64_t *)&escrow->hist[op] + i, __ATOMIC_RELAXED);
+        }
+        return 0;
 }
 
-int escrow_del(struct escrow *escrow, int16_t tag, int32_t idx) {
-        struct msg m = { .del = { .opcode = DEL, .tag = tag, .idx = idx } };
-        int        dummy;
-        return msend(&escrow->fd, &m, -1) ?: mrecv(&escrow->fd, &m, &dummy) ?: replied(escrow, &m);
+int64_t escrow_hist_quantile(const struct escrow_hist *hist, double q) {
+        int64_t total = 0;
+        int64_t seen  = 0;
+        for (int32_t i = 0; i < ESCROW_HIST_NR; ++i) {
+                total += hist->bucket[i];
+        }
+        for (int32_t i = 0; i < ESCROW_HIST_NR; ++i) {
+                seen += hist->bucket[i];
+                if (seen > 0 && seen >= q * total) {
+                        return (int64_t)2 << i;
+                }
+        }
+        return 0;
+}
+
+const char *escrow_op_name(int32_t op) {
+        static const char *name[ESCROW_OP_NR] = {
+                [ESCROW_OP_INIT]          = "init",
+                [ESCROW_OP_TAG]           = "tag",
+                [ESCROW_OP_GET]           = "get",
+                [ESCROW_OP_SET]           = "set",
+                [ESCROW_OP_RECOVER]       = "recover",
+                [ESCROW_OP_ADD]           = "add",
+                [ESCROW_OP_ADD_REF]       = "add_ref",
+                [ESCROW_OP_DEL]           = "del",
+                [ESCROW_OP_DEL_RANGE]     = "del_range",
+                [ESCROW_OP_ADDV]          = "addv",
+                [ESCROW_OP_GETV]          = "getv",
+                [ESCROW_OP_MANIFEST]      = "manifest",
+                [ESCROW_OP_EPOLL_SAVE]    = "epoll_save",
+                [ESCROW_OP_EPOLL_RESTORE] = "epoll_restore",
+                [ESCROW_OP_TAKEOVER]      = "takeover",
+                [ESCROW_OP_STATS]         = "stats",
+                [ESCROW_OP_SYNC]          = "sync",
+                [ESCROW_OP_WATCH]         = "watch",
+                [ESCROW_OP_LEASE]         = "lease"
+        };
+        return 0 <= op && op < ESCROW_OP_NR ? name[op] : "unknown";
 }
 
 /*
@@ -35,7 +35,8 @@
  * single-threaded and can have at most a single client at a time. Hence, the
  * new service version binary can start before the previous instance terminated:
  * it will be safely blocked in an attempt to connect to escrowd until the
- * previous instance disconnects.
+ * previous instance disconnects, or until it takes the escrow over from the
+ * previous instance with escrow_takeover().
  *
  * The same mechanism can be used for recovery after a process crash, except in
  * this case there is no guarantee that the connections were left in some known
@@ -68,6 +69,12 @@
  * sockets in another. The recovery can first recover all listeners and then all
  * streams. The total number of tags is specified when the escrow is created.
  *
+ * Each tag belongs to a recovery priority class (see escrow_set() and
+ * ESCROW_PRIO). escrow_recover() streams all descriptors of a class over the
+ * connection in one request and returns after the class is complete, so that,
+ * for example, listeners can be put back to work before the (much more
+ * numerous) streams are recovered.
+ *
  * In addition to the tag and the index, a file descriptor has an optional
  * "payload" of up to 32KB. The payload is stored in and retrieved from the
  * escrow together with the file descriptor. In fact, it is possible to store
@@ -82,8 +89,31 @@
  *
  * CONCURRENCY
  *
- * The interface is neither MT nor ASYNC safe. In case of a multi-threaded user,
- * explicit serialisation is needed.
+ * The interface is not ASYNC safe. By default it is not MT safe either. When
+ * escrow_init() is called with ESCROW_MT flag, any thread can call any function
+ * on the escrow concurrently: requests from all threads are multiplexed over the
+ * single connection and each thread waits only for its own reply, no explicit
+ * serialisation is needed. Functions exchanging multiple messages
+ * (escrow_recover()) occupy the connection for the entire exchange.
+ *
+ * LIVE UPGRADE
+ *
+ * When the old and the new service instances overlap, ESCROW_PIDFD saves the
+ * passage of each descriptor through escrowd and escrowd holding a duplicate of
+ * it. The old instance escrow_add()-s with ESCROW_PIDFD, calls escrow_fini()
+ * and stays alive until the new one has retrieved the descriptors. Payloads
+ * are stored in escrowd as usual.
+ *
+ * Fetching a descriptor from another process requires the permission to
+ * ptrace(2) it. When the retrieving process lacks it, escrow_get(),
+ * escrow_getv() and escrow_recover() ask escrowd to fetch the descriptor, after
+ * which escrowd holds it as if it were added without ESCROW_PIDFD. Descriptors
+ * stay in the adding process only if escrowd may fetch them, so that this is
+ * always possible. A slot whose descriptor cannot be fetched at all is
+ * delivered by escrow_recover() with the descriptor of -1. A descriptor cannot
+ * be fetched after the adding process exited. The slot records the file along
+ * with the descriptor number: if the adding process closes the descriptor and
+ * reuses the number for another file, fetching fails with -ESTALE.
  *
  * TRANSPORTABILITY
  *
@@ -108,7 +138,56 @@ enum {
         /* Output errors and messages exchanged with escrowd on stderr. */
         ESCROW_VERBOSE = 1 << 1,
         /* Force unlink of the socket when a new escrowd is started. */
-        ESCROW_FORCE   = 1 << 2
+        ESCROW_FORCE   = 1 << 2,
+        /* Make the escrow connection MT safe, see CONCURRENCY above. */
+        ESCROW_MT      = 1 << 3,
+        /*
+         * Use io_uring (Linux) to send and receive batches of messages in a
+         * single system call. Silently ignored if io_uring is not available.
+         */
+        ESCROW_URING   = 1 << 4,
+        /*
+         * Make a newly started escrowd watch stored sockets and drop the ones
+         * whose peers hung up (Linux).
+         */
+        ESCROW_REAP    = 1 << 5,
+        /*
+         * As ESCROW_REAP, but keep the slots, marked dead: escrow_recover()
+         * skips them, escrow_get() still returns them.
+         */
+        ESCROW_MARK    = 1 << 6,
+        /*
+         * Make escrow_add() remember the hashes of the payloads sent and, when
+         * a payload is sent again, reference it with escrow_add_ref() instead.
+         */
+        ESCROW_DEDUP   = 1 << 7,
+        /*
+         * Write-behind: escrow_add() and escrow_del() do not wait for escrowd
+         * replies. Failures are deferred and returned by escrow_sync().
+         */
+        ESCROW_BEHIND  = 1 << 8,
+        /*
+         * Descriptors stay in the process that added them: escrowd records the
+         * process and the descriptor numbers, and the retrieving process
+         * fetches the descriptors directly from the adding one with
+         * pidfd_getfd(2) (Linux 5.6). Only works while the adding process is
+         * alive, see LIVE UPGRADE below. Silently ignored without pidfds.
+         */
+        ESCROW_PIDFD   = 1 << 9,
+        /* Aggregate per-operation statistics, see escrow_hist(). */
+        ESCROW_HIST    = 1 << 10,
+        /*
+         * Keep a client-side index of the slots: escrow_add() of a slot with
+         * the same descriptor (the number and the file) and payload as
+         * escrowd already has returns 0 without a request, escrow_get() of an
+         * absent slot returns -ENOENT without a request. The index is read
+         * with escrow_manifest() by the first operation that needs it, is
+         * maintained by the operations of this connection and is re-read when
+         * escrowd changes the slots on its own: leases expire, sockets are
+         * reaped, ESCROW_BEHIND requests fail, the escrow is taken over.
+         * Linux. Silently ignored if escrowd does not support it.
+         */
+        ESCROW_SHADOW  = 1 << 11
 };
 
 /*
@@ -120,6 +199,95 @@ int  escrow_init(const char *path, uint32_t flags, int32_t nr_tags, struct escro
 /* Finalises the escrow connection. */
 void escrow_fini(struct escrow *escrow);
 
+/* Operations reported to escrow_hooks and aggregated in escrow_hist. */
+enum escrow_op {
+        ESCROW_OP_INIT,
+        ESCROW_OP_TAG,
+        ESCROW_OP_GET,       /* escrow_get(), escrow_get_ready(). */
+        ESCROW_OP_SET,
+        ESCROW_OP_RECOVER,
+        ESCROW_OP_ADD,
+        ESCROW_OP_ADD_REF,
+        ESCROW_OP_DEL,
+        ESCROW_OP_DEL_RANGE, /* escrow_del_range(), escrow_clear_except(). */
+        ESCROW_OP_ADDV,
+        ESCROW_OP_GETV,
+        ESCROW_OP_MANIFEST,
+        ESCROW_OP_EPOLL_SAVE,
+        ESCROW_OP_EPOLL_RESTORE,
+        ESCROW_OP_TAKEOVER,
+        ESCROW_OP_STATS,
+        ESCROW_OP_SYNC,
+        ESCROW_OP_WATCH,
+        ESCROW_OP_LEASE,
+        ESCROW_OP_NR
+};
+
+/*
+ * An operation, passed to escrow_hooks. Times are CLOCK_MONOTONIC nanoseconds.
+ * Bytes and descriptors are the ones exchanged with escrowd, a function
+ * calling another one (escrow_epoll_save() calls escrow_epoll_savev()) is
+ * reported as a single operation.
+ */
+struct escrow_op_info {
+        int32_t  op;       /* enum escrow_op. */
+        int16_t  tag;      /* -1 if the operation has no tag. */
+        int32_t  idx;      /* -1 if the operation has no index. */
+        int      result;   /* The return value, set at the end. */
+        uint64_t start;
+        uint64_t end;      /* Set at the end. */
+        int64_t  sent;     /* Bytes sent. */
+        int64_t  recv;     /* Bytes received. */
+        int32_t  fds_sent;
+        int32_t  fds_recv;
+};
+
+/*
+ * Observer of the operations on an escrow, see escrow_init_hooks(). Either
+ * function can be NULL. Called in the thread calling the escrow function,
+ * they must not call escrow functions themselves.
+ */
+struct escrow_hooks {
+        /* Called before the operation starts. Only op, tag, idx and start are set. */
+        void (*start)(void *arg, const struct escrow_op_info *info);
+        /* Called when the operation completes. */
+        void (*end)(void *arg, const struct escrow_op_info *info);
+        void  *arg;
+};
+
+/*
+ * As escrow_init(), additionally registers the HOOKS (copied, can be NULL),
+ * which observe all operations on the escrow, including this one.
+ */
+int escrow_init_hooks(const char *path, uint32_t flags, int32_t nr_tags,
+                      const struct escrow_hooks *hooks, struct escrow **escrow);
+
+enum { ESCROW_HIST_NR = 40 };
+
+/* Aggregated statistics of an operation, see ESCROW_HIST. */
+struct escrow_hist {
+        int64_t nr;       /* Completed operations. */
+        int64_t nr_err;   /* Failed operations. */
+        int64_t time;     /* Total latency, nanoseconds. */
+        int64_t sent;
+        int64_t recv;
+        int64_t fds_sent;
+        int64_t fds_recv;
+        /* Latencies: bucket[i] counts operations taking [2^i, 2^(i+1)) ns, the last also longer. */
+        int64_t bucket[ESCROW_HIST_NR];
+};
+
+/*
+ * Returns the statistics of the operation OP accumulated since escrow_init()
+ * with ESCROW_HIST, -EOPNOTSUPP without it. With ESCROW_MT the fields are
+ * sampled one by one, not as a whole.
+ */
+int escrow_hist(struct escrow *escrow, int32_t op, struct escrow_hist *hist);
+/* Returns the latency (an upper bound, ns) below which the fraction Q of operations completed. */
+int64_t escrow_hist_quantile(const struct escrow_hist *hist, double q);
+/* Returns the name of the operation ("add", "get", ...), for reporting. */
+const char *escrow_op_name(int32_t op);
+
 /*
  * Returns information about a tag.
  *
@@ -142,10 +310,342 @@ int escrow_tag(struct escrow *escrow, int16_t tag, int32_t *nr, int32_t *nob);
  * It is up to the user to close the returned file descriptor.
  */
 int escrow_get(struct escrow *escrow, int16_t tag, int32_t idx, int *fd, int32_t *nob, void *data);
+/*
+ * As escrow_get(), and also returns the descriptor readiness (ESCROW_{IN,OUT,HUP})
+ * in *READY and the number of bytes of input pending in *PENDING, as observed
+ * by escrowd.
+ */
+int escrow_get_ready(struct escrow *escrow, int16_t tag, int32_t idx, int *fd, int32_t *nob,
+                     void *data, uint32_t *ready, int32_t *pending);
 /* Places the descriptor and its payload in the escrow. */
 int escrow_add(struct escrow *escrow, int16_t tag, int32_t idx, int  fd, int32_t  nob, void *data);
+/*
+ * Escrowd stores identical payloads once. This returns the hash by which a
+ * stored payload can be referenced, see escrow_add_ref().
+ */
+uint64_t escrow_hash(const void *data, int32_t nob);
+/*
+ * As escrow_add(), but instead of sending the payload, uses the payload already
+ * stored in the escrow (with any descriptor) that has the given HASH. Returns
+ * -ENOENT if there is none. Payloads are identified by the 64-bit hash alone.
+ */
+int escrow_add_ref(struct escrow *escrow, int16_t tag, int32_t idx, int fd, uint64_t hash);
 /* Deletes the descriptor and its payload from the escrow. */
 int escrow_del(struct escrow *escrow, int16_t tag, int32_t idx);
+/*
+ * Deletes all descriptors with indices in [IDX, END) from the tag, or from all
+ * tags with ESCROW_ALL, in a single request.
+ */
+int escrow_del_range(struct escrow *escrow, int16_t tag, int32_t idx, int32_t end);
+/*
+ * Deletes all descriptors from the tag (or from all tags with ESCROW_ALL),
+ * except the ones with the NR indices in KEEP (in any order). With NR == 0
+ * clears the tag. Escrowd receives the gaps between the kept indices as ranges,
+ * thousands per request.
+ */
+int escrow_clear_except(struct escrow *escrow, int16_t tag, int32_t nr, const int32_t *keep);
+
+/* Tag attributes, see escrow_set(). */
+enum escrow_attr {
+        /*
+         * Recovery priority class of the tag, in [INT16_MIN, INT16_MAX]. Lower
+         * classes are recovered first. Default is 0.
+         */
+        ESCROW_PRIO,
+        /*
+         * Payloads of at least that many bytes are compressed in escrowd
+         * memory (if they compress well). 0, the default, disables compression.
+         * Applies to the descriptors added after the attribute is set.
+         */
+        ESCROW_ZIP,
+        /*
+         * Quotas: the maximal number of slots, of stored descriptors and of
+         * payload kilobytes in the tag, 0 (the default) for no limit. With
+         * ESCROW_ALL as the tag, the quota applies to the whole escrow.
+         * escrow_add() that would exceed a quota fails with -EDQUOT. Setting
+         * the escrow descriptor quota raises escrowd RLIMIT_NOFILE to match.
+         */
+        ESCROW_MAX_SLOTS,
+        ESCROW_MAX_FDS,
+        ESCROW_MAX_KB,
+        /*
+         * Lease, in milliseconds, that the descriptors added to the tag get,
+         * see escrow_lease(). 0, the default, for none.
+         */
+        ESCROW_TTL
+};
+
+/* The "tag" that stands for the whole escrow in escrow_set(). */
+enum { ESCROW_ALL = -1 };
+
+/* Resource usage or limits, see escrow_stats::use and ESCROW_MAX_*. */
+struct escrow_quota {
+        int32_t slots;
+        int32_t fds;
+        int64_t nob;
+};
+
+/* Sets an attribute of a tag. */
+int escrow_set(struct escrow *escrow, int16_t tag, int16_t attr, int32_t val);
+
+/*
+ * Sets or renews a lease: unless renewed within TTL milliseconds, the slot is
+ * deleted (its descriptor closed). With ESCROW_ALL as the index, the lease is
+ * on the whole tag, and with ESCROW_ALL as the tag too, on the whole escrow:
+ * when such a lease expires, all slots under it are deleted. TTL 0 cancels the
+ * lease. escrow_add() replaces the slot and with it the lease, see ESCROW_TTL.
+ * Expired slots are counted in escrow_stats::nr_expired and reported to the
+ * watchers as deleted. With ESCROW_BEHIND does not wait for the reply.
+ */
+int escrow_lease(struct escrow *escrow, int16_t tag, int32_t idx, int32_t ttl);
+
+/* Descriptor readiness, as observed by escrowd, see escrow_slot::ready. */
+enum {
+        ESCROW_IN  = 1 << 0, /* Input (or, for a listener, a connection) is pending. */
+        ESCROW_OUT = 1 << 1, /* Writable. */
+        ESCROW_HUP = 1 << 2  /* The peer hung up or an error is pending. */
+};
+
+/* A descriptor retrieved from the escrow, passed to escrow_cb_t. */
+struct escrow_slot {
+        int16_t     tag;
+        int32_t     idx;
+        int         fd;
+        int32_t     nob;
+        const void *data;    /* Valid only for the duration of the call. */
+        uint32_t    ready;   /* ESCROW_{IN,OUT,HUP}. Ignored by escrow_addv(). */
+        int32_t     pending; /* Bytes of input pending. Ignored by escrow_addv(). */
+};
+
+/*
+ * Call-back invoked by escrow_recover() for each retrieved descriptor. It is up
+ * to the call-back to close SLOT->fd. If the call-back returns non-zero, the
+ * remaining descriptors of the class are closed and the value is returned from
+ * escrow_recover(). The call-back must not call escrow functions on the same
+ * escrow.
+ */
+typedef int (*escrow_cb_t)(void *arg, const struct escrow_slot *slot);
+
+/*
+ * Retrieves all descriptors in the next priority class.
+ *
+ * Escrowd finds the lowest priority class not less than *PRIO that has
+ * descriptors and streams all of them in one go, calling CB for each. Escrowd
+ * polls the descriptors before sending them: SLOT->ready and SLOT->pending
+ * tell which ones have queued input, and these are streamed first. On return
+ * *PRIO is set to the next class to ask for. Returns -ENOENT when there are no
+ * more classes. A typical recovery loop is:
+ *
+ *     int32_t prio = INT16_MIN;
+ *     while ((result = escrow_recover(escrow, &prio, cb, arg)) == 0) {
+ *             ... the class is recovered, resume part of the service ...
+ *     }
+ *
+ * Descriptors are not removed from the escrow.
+ */
+int escrow_recover(struct escrow *escrow, int32_t *prio, escrow_cb_t cb, void *arg);
+
+/*
+ * Places NR descriptors and their payloads in the escrow.
+ *
+ * Equivalent to calling escrow_add() for each element of SLOTS, but the requests
+ * are pipelined: escrowd replies are collected in batches rather than waited
+ * for one by one, and with ESCROW_URING a whole batch of requests and replies
+ * takes a single system call. All slots are processed, the first error (if
+ * any) is returned.
+ */
+int escrow_addv(struct escrow *escrow, int32_t nr, const struct escrow_slot *slots);
+
+/*
+ * Retrieves the descriptors named by KEYS[i].tag and KEYS[i].idx (the other
+ * fields are ignored), pipelining the requests as escrow_addv() does. CB is
+ * called for each retrieved descriptor, as in escrow_recover(). Missing
+ * descriptors are skipped, the first error (e.g., -ENOENT) is returned after
+ * all keys are processed.
+ */
+int escrow_getv(struct escrow *escrow, int32_t nr, const struct escrow_slot *keys, escrow_cb_t cb,
+                void *arg);
+
+/* A run of consecutive present indices in a tag, see escrow_manifest(). */
+struct escrow_run {
+        int16_t         tag;
+        uint16_t        flags; /* ESCROW_RUN_FD if the slots of the run have descriptors. */
+        int32_t         idx;   /* The first index of the run. */
+        int32_t         nr;    /* Number of slots in the run. */
+        /* Payload sizes of the slots. Valid only for the duration of the call. */
+        const uint16_t *nob;
+};
+
+enum {
+        ESCROW_RUN_FD = 1 << 0
+};
+
+typedef int (*escrow_run_cb_t)(void *arg, const struct escrow_run *run);
+
+/*
+ * Lists all descriptors in the escrow in one request.
+ *
+ * Escrowd streams the runs of present indices, in the order of tags and
+ * indices. CB is called for each run, runs are maximal, except that long
+ * runs can be split in several consecutive ones. If CB returns non-zero, the
+ * rest of the manifest is skipped and the value is returned.
+ */
+int escrow_manifest(struct escrow *escrow, escrow_run_cb_t cb, void *arg);
+
+/* A deferred failure, see escrow_sync(). */
+struct escrow_error {
+        int16_t tag;
+        int32_t idx;
+        int32_t rc;
+};
+
+/*
+ * Waits until escrowd processed all preceding requests and returns the
+ * failures of write-behind (ESCROW_BEHIND) requests since the last sync.
+ *
+ * *NR contains the size of the ERRORS array. On return, *NR is the number of
+ * failures (only the first ones are reported, if there are more than fit in
+ * ERRORS or than escrowd remembers). Returns the error of the first failure,
+ * or 0. NR can be NULL.
+ */
+int escrow_sync(struct escrow *escrow, int32_t *nr, struct escrow_error *errors);
+
+/* An epoll registration, see escrow_epoll_save(). */
+struct escrow_reg {
+        int32_t  fd;
+        uint32_t events;
+        uint64_t data;
+};
+
+/*
+ * Places the descriptors registered in the epoll instance EP in the escrow, in
+ * the tag (which should not be used for anything else), with their events
+ * masks and data (Linux, the registrations are read from /proc/self/fdinfo).
+ *
+ * The descriptors are passed up to 250 per message, with several messages in
+ * flight. Slots of the tag past the saved registrations, left from a larger
+ * set, are deleted. Returns the first failure. Failures of write-behind
+ * requests (ESCROW_BEHIND) are left for escrow_sync().
+ */
+int escrow_epoll_save(struct escrow *escrow, int16_t tag, int ep);
+/* As escrow_epoll_save(), but takes an explicit array of registrations. */
+int escrow_epoll_savev(struct escrow *escrow, int16_t tag, int32_t nr,
+                       const struct escrow_reg *regs);
+/*
+ * Creates a new epoll instance in *EP and registers there all descriptors of
+ * the tag, retrieved in batches, with the saved events masks and data.
+ *
+ * *NR contains the size of the REGS array: the first *NR retrieved descriptors
+ * (new numbers) and their registrations are placed there. The descriptors
+ * that do not fit are closed and the call fails with -ENOSPC. On return *NR is
+ * the number of retrieved descriptors (see escrow_tag()). On a failure *EP is
+ * closed and set to -1, the descriptors placed in REGS are the caller's.
+ */
+int escrow_epoll_restore(struct escrow *escrow, int16_t tag, int *ep, int32_t *nr,
+                         struct escrow_reg *regs);
+
+/* Kinds of escrow_event. */
+enum {
+        ESCROW_EV_ADD,    /* A new slot. */
+        ESCROW_EV_UPDATE, /* The slot was replaced (escrow_add() to a present index). */
+        ESCROW_EV_DEL,    /* The slot was deleted. */
+        /* All slots present at the subscription were reported (tag and idx are -1). */
+        ESCROW_EV_SYNCED
+};
+
+/* Flags of escrow_watch(). */
+enum {
+        ESCROW_WATCH_DATA = 1 << 0 /* Pass the payloads with ADD and UPDATE events. */
+};
+
+/* A change in the escrow, passed to escrow_event_cb_t. */
+struct escrow_event {
+        int16_t     type;
+        int16_t     tag;
+        int32_t     idx;
+        uint16_t    flags; /* ESCROW_RUN_FD if the slot has a descriptor. */
+        int32_t     nob;   /* Payload size. */
+        const void *data;  /* With ESCROW_WATCH_DATA, the payload, valid during the call. */
+};
+
+typedef int (*escrow_event_cb_t)(void *arg, const struct escrow_event *ev);
+
+/*
+ * Subscribes to the changes in the tag, or in all tags with ESCROW_ALL, and
+ * passes them to CB until CB returns non-zero, which is then returned. Meant
+ * for a warm standby tracking what the primary places in the escrow.
+ *
+ * Called right after escrow_init(): the connection becomes a watcher, it does
+ * not wait for (or hold) the session, and can only be finalised afterwards.
+ * The slots present at the subscription are reported as ESCROW_EV_ADD events,
+ * followed by ESCROW_EV_SYNCED.
+ *
+ * Escrowd delays the changes by up to 10 milliseconds and coalesces them: a
+ * burst of changes to a slot is reported once, with the state after the burst,
+ * and a slot added and deleted within a burst is not reported at all. A watcher
+ * that does not keep up is not waited for, its changes keep coalescing.
+ * Descriptors are not passed.
+ */
+int escrow_watch(struct escrow *escrow, int16_t tag, uint32_t flags, escrow_event_cb_t cb,
+                 void *arg);
+
+/*
+ * Emergency dump, for crash recovery: the descriptors and payloads registered
+ * in a preallocated table are placed in the escrow by escrow_dump(), which is
+ * async-signal-safe and can be called from a SIGSEGV or SIGABRT handler.
+ *
+ * escrow_dump_init() allocates a table of NR entries. escrow_dump_set()
+ * registers in the I-th entry the descriptor and the payload to be placed at
+ * (TAG, IDX). The payload is not copied: DATA must stay valid while it is
+ * registered. A negative tag clears the entry. The payload size is limited to
+ * ESCROW_DUMP_MAX. An interrupted escrow_dump_set() leaves the entry unused.
+ * escrow_dump_set() must not run concurrently with escrow_dump() in another
+ * thread: the dump copies the entries and payloads without locks, so it is
+ * only safe against the frames it interrupts.
+ *
+ * escrow_dump() sends all registered entries, with up to 250 descriptors per
+ * message, without waiting for the replies: the descriptors are safe in
+ * escrowd once it returns, even if the process dies right after. Failures are
+ * collected by escrow_sync() (if the process survives). No hooks are called.
+ */
+enum { ESCROW_DUMP_MAX = (1 << 15) - 16 };
+
+int escrow_dump_init(struct escrow *escrow, int32_t nr);
+int escrow_dump_set(struct escrow *escrow, int32_t i, int16_t tag, int32_t idx, int fd, int32_t nob,
+                    const void *data);
+int escrow_dump(struct escrow *escrow);
+
+/*
+ * Takes the escrow over from the process currently connected, without waiting
+ * for it to disconnect (see escrow_init()): escrowd serves this connection
+ * from now on and fences the old one, failing all its further requests with
+ * -ESTALE. Called right after escrow_init().
+ */
+int escrow_takeover(struct escrow *escrow);
+
+/*
+ * Returns 1 if the connection was fenced by escrow_takeover() in another
+ * process, 0 if not, as far as can be told without blocking. Escrowd notifies
+ * the fenced connection right away, so a draining process learns it without
+ * sending requests. Any request of a fenced connection fails with -ESTALE.
+ */
+int escrow_fenced(struct escrow *escrow);
+
+/* Escrowd statistics, see escrow_stats(). */
+struct escrow_stats {
+        int64_t nr_dead;    /* Slots currently marked dead (ESCROW_MARK). */
+        int64_t nr_reaped;  /* Dead slots dropped so far (ESCROW_REAP). */
+        int64_t nr_expired; /* Slots deleted so far, because their leases expired. */
+        int64_t nr_leases;  /* Leases currently held. */
+        int64_t zip_raw;    /* Original size of the payloads stored compressed. */
+        int64_t zip_packed; /* Their compressed size. */
+        int64_t nr_blobs;   /* Distinct payloads stored. */
+        int64_t blob_saved; /* Payload bytes not stored, because identical payloads are shared. */
+        struct escrow_quota use; /* Slots, descriptors and payload bytes in the escrow. */
+};
+
+/* Returns escrowd statistics. */
+int escrow_stats(struct escrow *escrow, struct escrow_stats *stats);
 
 #endif
 
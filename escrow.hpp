@@ -0,0 +1,508 @@
+/* -*- C++ -*- */
+/* Copyright 2024 Nikita Danilov <danilov@gmail.com> */
+/* See https://github.com/nikitadanilov/escrow/blob/master/LICENCE for the licencing information. */
+
+#ifndef __LIBESCROW_HPP__
+#define __LIBESCROW_HPP__
+
+/*
+ * C++20 interface to the file descriptor escrow library, see escrow.h.
+ *
+ * Header-only, a thin layer over the C interface:
+ *
+ *     - libescrow::connection owns an escrow connection;
+ *
+ *     - descriptors retrieved from the escrow are returned as move-only
+ *       libescrow::unique_fd, that closes the descriptor unless released;
+ *
+ *     - payloads are passed as std::span<const std::byte> (never copied by the
+ *       wrapper) or as values, serialised by libescrow::codec<T>;
+ *
+ *     - batch calls take ranges and map onto escrow_addv(), escrow_getv() and
+ *       escrow_recover(), that pipeline or stream the messages.
+ *
+ * Failures are reported by throwing std::system_error with the errno value
+ * returned by the C function. An absent descriptor is not a failure for
+ * connection::get(), which returns std::nullopt.
+ *
+ * Call-backs passed to getv(), recover() and for_each() receive a
+ * libescrow::slot &, they can take over the descriptor by moving slot::fd out,
+ * otherwise it is closed when the call-back returns. An exception thrown by a
+ * call-back stops the delivery (the remaining descriptors are closed) and is
+ * re-thrown to the caller.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <exception>
+#include <optional>
+#include <ranges>
+#include <span>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <unistd.h>
+
+extern "C" {
+#include "escrow.h"
+}
+
+namespace libescrow {
+
+/* Throws std::system_error if RC (a negated errno, as returned by escrow_*()) is non-zero. */
+inline void check(int rc, const char *what) {
+        if (rc != 0) {
+                throw std::system_error(-rc, std::generic_category(), what);
+        }
+}
+
+/* Owner of a file descriptor. */
+class unique_fd {
+public:
+        unique_fd() noexcept = default;
+        explicit unique_fd(int fd) noexcept : fd_(fd) {}
+        unique_fd(unique_fd &&other) noexcept : fd_(other.release()) {}
+        unique_fd &operator=(unique_fd &&other) noexcept {
+                reset(other.release());
+                return *this;
+        }
+        unique_fd(const unique_fd &) = delete;
+        unique_fd &operator=(const unique_fd &) = delete;
+        ~unique_fd() {
+                reset();
+        }
+        int get() const noexcept {
+                return fd_;
+        }
+        /* Gives up the ownership. */
+        int release() noexcept {
+                return std::exchange(fd_, -1);
+        }
+        void reset(int fd = -1) noexcept {
+                if (fd_ >= 0 && fd_ != fd) {
+                        ::close(fd_);
+                }
+                fd_ = fd;
+        }
+        explicit operator bool() const noexcept {
+                return fd_ >= 0;
+        }
+private:
+        int fd_ = -1;
+};
+
+/*
+ * Payload serialisation.
+ *
+ * The primary template stores the object representation of a trivially
+ * copyable type. Specialise it for other types: encode() returns a view of the
+ * bytes to store (valid while the value is), decode() reconstructs the value.
+ */
+template <typename T>
+struct codec {
+        static_assert(std::is_trivially_copyable_v<T>,
+                      "Specialise libescrow::codec<T> for this type.");
+        static std::span<const std::byte> encode(const T &val) noexcept {
+                return std::as_bytes(std::span(&val, 1));
+        }
+        static T decode(std::span<const std::byte> data) {
+                T val;
+                if (data.size() != sizeof val) {
+                        throw std::system_error(EMSGSIZE, std::generic_category(),
+                                                "libescrow::codec::decode");
+                }
+                std::memcpy(&val, data.data(), sizeof val);
+                return val;
+        }
+};
+
+template <>
+struct codec<std::string> {
+        static std::span<const std::byte> encode(const std::string &val) noexcept {
+                return std::as_bytes(std::span(val.data(), val.size()));
+        }
+        static std::string decode(std::span<const std::byte> data) {
+                return std::string(reinterpret_cast<const char *>(data.data()), data.size());
+        }
+};
+
+template <>
+struct codec<std::vector<std::byte>> {
+        static std::span<const std::byte> encode(const std::vector<std::byte> &val) noexcept {
+                return val;
+        }
+        static std::vector<std::byte> decode(std::span<const std::byte> data) {
+                return std::vector<std::byte>(data.begin(), data.end());
+        }
+};
+
+template <typename T>
+inline constexpr bool is_span_v = false;
+
+template <typename T, std::size_t N>
+inline constexpr bool is_span_v<std::span<T, N>> = true;
+
+/* A type that can be stored as a payload. Spans are passed as raw bytes instead. */
+template <typename T>
+concept payload = !is_span_v<T> && requires(const T &val, std::span<const std::byte> data) {
+        { codec<T>::encode(val) } -> std::convertible_to<std::span<const std::byte>>;
+        { codec<T>::decode(data) } -> std::same_as<T>;
+};
+
+inline std::span<const std::byte> bytes(const void *data, int32_t nob) noexcept {
+        return { static_cast<const std::byte *>(data), static_cast<std::size_t>(nob) };
+}
+
+/* A descriptor retrieved from the escrow, passed to call-backs. */
+struct slot {
+        int16_t                    tag;
+        int32_t                    idx;
+        unique_fd                  fd;
+        std::span<const std::byte> data;    /* Valid only for the duration of the call-back. */
+        uint32_t                   ready;   /* ESCROW_{IN,OUT,HUP}, from recover() only. */
+        int32_t                    pending; /* Ditto. */
+
+        template <payload T>
+        T as() const {
+                return codec<T>::decode(data);
+        }
+};
+
+/* A descriptor to place in the escrow, see connection::addv(). */
+struct entry {
+        int16_t                    tag;
+        int32_t                    idx;
+        int                        fd   = -1;
+        std::span<const std::byte> data = {};
+};
+
+/* Identifies a descriptor in the escrow, see connection::getv(). */
+struct key {
+        int16_t tag;
+        int32_t idx;
+};
+
+/* Result of connection::get() with a caller-supplied buffer. */
+struct got {
+        unique_fd            fd;
+        std::span<std::byte> data; /* The prefix of the buffer filled with the payload. */
+        int32_t              nob;  /* Payload size, greater than data.size() if truncated. */
+};
+
+namespace detail {
+
+/* Adapts a C++ call-back to escrow_cb_t. */
+template <typename F>
+struct callback {
+        F                  &f;
+        std::exception_ptr  error = nullptr;
+        int32_t             nr    = 0;
+
+        static int run(void *arg, const struct escrow_slot *s) noexcept {
+                auto *self = static_cast<callback *>(arg);
+                slot  sl   = { s->tag, s->idx, unique_fd(s->fd), bytes(s->data, s->nob),
+                               s->ready, s->pending };
+                try {
+                        self->f(sl);
+                        ++self->nr;
+                        return 0;
+                } catch (...) {
+                        self->error = std::current_exception();
+                        return -ECANCELED;
+                }
+        }
+
+        static int on_run(void *arg, const struct escrow_run *run) noexcept {
+                auto *self = static_cast<callback *>(arg);
+                try {
+                        self->f(*run);
+                        ++self->nr;
+                        return 0;
+                } catch (...) {
+                        self->error = std::current_exception();
+                        return -ECANCELED;
+                }
+        }
+
+        /* F returns false to stop watching. */
+        static int on_event(void *arg, const struct escrow_event *ev) noexcept {
+                auto *self = static_cast<callback *>(arg);
+                try {
+                        ++self->nr;
+                        return self->f(*ev) ? 0 : 1;
+                } catch (...) {
+                        self->error = std::current_exception();
+                        return -ECANCELED;
+                }
+        }
+
+        void check(int rc, const char *what) const {
+                if (error != nullptr) {
+                        std::rethrow_exception(error);
+                }
+                libescrow::check(rc, what);
+        }
+};
+
+}
+
+/* An escrow connection. Move-only, finalised by the destructor. */
+class connection {
+public:
+        /* See escrow_init(). */
+        explicit connection(const char *path, uint32_t flags = ESCROW_CREAT, int32_t nr_tags = 32) {
+                check(escrow_init(path, flags, nr_tags, &e_), "escrow_init");
+        }
+        /* See escrow_init_hooks(). */
+        connection(const char *path, uint32_t flags, int32_t nr_tags,
+                   const struct escrow_hooks &hooks) {
+                check(escrow_init_hooks(path, flags, nr_tags, &hooks, &e_), "escrow_init_hooks");
+        }
+        /* Takes over an escrow connection established with escrow_init(). */
+        explicit connection(struct escrow *e) noexcept : e_(e) {}
+        connection(connection &&other) noexcept : e_(std::exchange(other.e_, nullptr)) {}
+        connection &operator=(connection &&other) noexcept {
+                if (this != &other) {
+                        fini();
+                        e_ = std::exchange(other.e_, nullptr);
+                }
+                return *this;
+        }
+        connection(const connection &) = delete;
+        connection &operator=(const connection &) = delete;
+        ~connection() {
+                fini();
+        }
+        /* The underlying C connection, for the calls not wrapped here. */
+        struct escrow *get() const noexcept {
+                return e_;
+        }
+
+        void add(int16_t tag, int32_t idx, int fd, std::span<const std::byte> data = {}) {
+                auto *buf = const_cast<std::byte *>(data.data());
+                check(escrow_add(e_, tag, idx, fd, data.size(), buf), "escrow_add");
+        }
+        template <payload T>
+        void add(int16_t tag, int32_t idx, int fd, const T &val) {
+                add(tag, idx, fd, codec<T>::encode(val));
+        }
+        /* See escrow_add_ref(). Returns false if escrowd has no payload with the hash. */
+        bool add_ref(int16_t tag, int32_t idx, int fd, uint64_t hash) {
+                int rc = escrow_add_ref(e_, tag, idx, fd, hash);
+                if (rc == -ENOENT) {
+                        return false;
+                }
+                check(rc, "escrow_add_ref");
+                return true;
+        }
+        static uint64_t hash(std::span<const std::byte> data) noexcept {
+                return escrow_hash(data.data(), data.size());
+        }
+        /*
+         * Places all entries (libescrow::entry or struct escrow_slot) of the
+         * range in the escrow with a single escrow_addv(). A contiguous range
+         * of escrow_slot is passed as is, otherwise only the (small) slot
+         * descriptions are gathered, the payloads are never copied.
+         */
+        template <std::ranges::input_range R>
+        void addv(R &&range) {
+                using T = std::remove_cvref_t<std::ranges::range_reference_t<R>>;
+                if constexpr (std::ranges::contiguous_range<R> && std::ranges::sized_range<R> &&
+                              std::is_same_v<T, struct escrow_slot>) {
+                        check(escrow_addv(e_, std::ranges::size(range), std::ranges::data(range)),
+                              "escrow_addv");
+                } else {
+                        std::vector<struct escrow_slot> slots;
+                        if constexpr (std::ranges::sized_range<R>) {
+                                slots.reserve(std::ranges::size(range));
+                        }
+                        for (const T &e : range) {
+                                if constexpr (std::is_same_v<T, struct escrow_slot>) {
+                                        slots.push_back(e);
+                                } else {
+                                        int32_t nob = static_cast<int32_t>(e.data.size());
+                                        slots.push_back({ .tag = e.tag, .idx = e.idx, .fd = e.fd,
+                                                          .nob = nob, .data = e.data.data(),
+                                                          .ready = 0, .pending = 0 });
+                                }
+                        }
+                        check(escrow_addv(e_, slots.size(), slots.data()), "escrow_addv");
+                }
+        }
+
+        /* Retrieves a descriptor, the payload is copied into BUF (truncated if necessary). */
+        std::optional<got> get(int16_t tag, int32_t idx, std::span<std::byte> buf) {
+                int     fd  = -1;
+                int32_t nob = buf.size();
+                int     rc  = escrow_get(e_, tag, idx, &fd, &nob, buf.data());
+                if (rc == -ENOENT) {
+                        return std::nullopt;
+                }
+                check(rc, "escrow_get");
+                return got{ unique_fd(fd), buf.first(std::min<std::size_t>(nob, buf.size())), nob };
+        }
+        /* Retrieves a descriptor and decodes its payload, without intermediate copies. */
+        template <payload T>
+        std::optional<std::pair<unique_fd, T>> get(int16_t tag, int32_t idx) {
+                std::optional<std::pair<unique_fd, T>> result;
+                key k = { tag, idx };
+                getv(std::span(&k, 1), [&result](slot &s) {
+                        result.emplace(std::move(s.fd), s.as<T>());
+                });
+                return result;
+        }
+        /*
+         * Retrieves the descriptors for the range of keys with a single
+         * escrow_getv() and calls F(slot &) for each. Absent descriptors are
+         * skipped. Returns the number of descriptors delivered.
+         */
+        template <std::ranges::input_range R, typename F>
+        int32_t getv(R &&keys, F &&f) {
+                std::vector<struct escrow_slot> slots;
+                detail::callback<F>             cb = { f };
+                int                             rc;
+                if constexpr (std::ranges::sized_range<R>) {
+                        slots.reserve(std::ranges::size(keys));
+                }
+                for (const key &k : keys) {
+                        slots.push_back({ .tag = k.tag, .idx = k.idx, .fd = -1, .nob = 0,
+                                          .data = nullptr, .ready = 0, .pending = 0 });
+                }
+                rc = escrow_getv(e_, slots.size(), slots.data(), &detail::callback<F>::run, &cb);
+                cb.check(rc == -ENOENT ? 0 : rc, "escrow_getv");
+                return cb.nr;
+        }
+
+        /*
+         * Recovers the next priority class, see escrow_recover(). Returns false
+         * when there are no more classes.
+         */
+        template <typename F>
+        bool recover(int32_t &prio, F &&f) {
+                detail::callback<F> cb = { f };
+                int                 rc = escrow_recover(e_, &prio, &detail::callback<F>::run, &cb);
+                if (rc == -ENOENT && cb.error == nullptr) {
+                        return false;
+                }
+                cb.check(rc, "escrow_recover");
+                return true;
+        }
+        /* Iterates over all descriptors in the escrow, class by class. */
+        template <typename F>
+        void for_each(F &&f) {
+                for (int32_t prio = INT16_MIN; recover(prio, f);) {
+                        ;
+                }
+        }
+
+        /* Calls F(const escrow_run &) for each run of present indices, see escrow_manifest(). */
+        template <typename F>
+        void manifest(F &&f) {
+                detail::callback<F> cb = { f };
+                cb.check(escrow_manifest(e_, &detail::callback<F>::on_run, &cb), "escrow_manifest");
+        }
+
+        /* Calls F(const escrow_event &) for changes until it returns false, see escrow_watch(). */
+        template <typename F>
+        void watch(int16_t tag, uint32_t flags, F &&f) {
+                detail::callback<F> cb = { f };
+                int                 rc = escrow_watch(e_, tag, flags,
+                                                      &detail::callback<F>::on_event, &cb);
+                cb.check(rc > 0 ? 0 : rc, "escrow_watch");
+        }
+
+        void del(int16_t tag, int32_t idx) {
+                check(escrow_del(e_, tag, idx), "escrow_del");
+        }
+        /* Deletes the indices in [idx, end). */
+        void del(int16_t tag, int32_t idx, int32_t end) {
+                check(escrow_del_range(e_, tag, idx, end), "escrow_del_range");
+        }
+        void clear(int16_t tag, std::span<const int32_t> keep = {}) {
+                check(escrow_clear_except(e_, tag, keep.size(), keep.data()),
+                      "escrow_clear_except");
+        }
+        void set(int16_t tag, int16_t attr, int32_t val) {
+                check(escrow_set(e_, tag, attr, val), "escrow_set");
+        }
+        /* TTL in milliseconds, 0 cancels the lease, see escrow_lease(). */
+        void lease(int16_t tag, int32_t idx, int32_t ttl) {
+                check(escrow_lease(e_, tag, idx, ttl), "escrow_lease");
+        }
+        /* Returns the number of descriptors in the tag and the total size of their payloads. */
+        std::pair<int32_t, int32_t> tag(int16_t tag) {
+                int32_t nr;
+                int32_t nob;
+                check(escrow_tag(e_, tag, &nr, &nob), "escrow_tag");
+                return { nr, nob };
+        }
+        /* See escrow_sync(). Returns the deferred failures (at most MAX), rather than throwing. */
+        std::vector<struct escrow_error> sync(int32_t max = 64) {
+                std::vector<struct escrow_error> err(max);
+                int32_t                          nr = max;
+                int                              rc = escrow_sync(e_, &nr, err.data());
+                if (nr == 0) {
+                        check(rc, "escrow_sync");
+                }
+                err.resize(std::min(nr, max));
+                return err;
+        }
+        /* See escrow_dump_init() and escrow_dump_set(). */
+        void dump_init(int32_t nr) {
+                check(escrow_dump_init(e_, nr), "escrow_dump_init");
+        }
+        void dump_set(int32_t i, int16_t tag, int32_t idx, int fd,
+                      std::span<const std::byte> payload = {}) {
+                check(escrow_dump_set(e_, i, tag, idx, fd, payload.size(), payload.data()),
+                      "escrow_dump_set");
+        }
+        /* Async-signal-safe, does not throw. */
+        int dump() noexcept {
+                return escrow_dump(e_);
+        }
+        void takeover() {
+                check(escrow_takeover(e_), "escrow_takeover");
+        }
+        bool fenced() {
+                int rc = escrow_fenced(e_);
+                check(rc < 0 ? rc : 0, "escrow_fenced");
+                return rc > 0;
+        }
+        struct escrow_stats stats() {
+                struct escrow_stats st;
+                check(escrow_stats(e_, &st), "escrow_stats");
+                return st;
+        }
+        /* Requires ESCROW_HIST. */
+        struct escrow_hist hist(enum escrow_op op) {
+                struct escrow_hist h;
+                check(escrow_hist(e_, op, &h), "escrow_hist");
+                return h;
+        }
+private:
+        void fini() noexcept {
+                if (e_ != nullptr) {
+                        escrow_fini(e_);
+                        e_ = nullptr;
+                }
+        }
+        struct escrow *e_ = nullptr;
+};
+
+}
+
+#endif
+
+/*
+ *  Local variables:
+ *  c-indentation-style: "K&R"
+ *  c-basic-offset: 8
+ *  tab-width: 8
+ *  scroll-step: 1
+ *  indent-tabs-mode: nil
+ *  End:
+ */
@@ -10,7 +10,7 @@
 #include <unistd.h>
 #include "escrow.h"
 
-int escrowd(const char *path, uint32_t flags, int32_t nr_tags);
+int escrowd(const char *path, uint32_t flags, int32_t nr_tags, const struct escrow_quota *quota);
 
 enum { NR_TAGS = 32 };
 
@@ -21,7 +21,14 @@ static void usage() {
                 "        -d           Daemonise (otherwise runs in foreground).\n"
                 "        -v           Make the daemon verbose.\n"
                 "        -f           Force re-creation of the socket if it already exists.\n"
+                "        -u           Use io_uring for batched message transfers, if available.\n"
+                "        -r           Drop stored sockets whose peers hung up (Linux).\n"
+                "        -m           Mark stored sockets whose peers hung up as dead (Linux).\n"
                 "        -t nr_tags   Set the number of tags (default: %i).\n"
+                "        -s slots     Limit the total number of slots.\n"
+                "        -n fds       Limit the total number of stored descriptors,\n"
+                "                     raise RLIMIT_NOFILE to match.\n"
+                "        -b bytes     Limit the total size of payloads.\n"
                 "        -h           Dsiplay this help message.\n\n",
                 NR_TAGS);
         exit(EXIT_FAILURE);
@@ -32,7 +39,8 @@ int main(int argc, char **argv) {
         uint32_t flags     = 0;
         int32_t  nr_tags   = 32;
         bool     daemonise = false;
-        while ((opt = getopt(argc, argv, "hdfvt:")) != -1) {
+        struct escrow_quota quota = {};
+        while ((opt = getopt(argc, argv, "hdfuvrmt:s:n:b:")) != -1) {
                 switch (opt) {
                 case 'd':
                         daemonise = true;
@@ -43,9 +51,27 @@ int main(int argc, char **argv) {
                 case 'v':
                         flags |= ESCROW_VERBOSE;
                         break;
+                case 'u':
+                        flags |= ESCROW_URING;
+                        break;
+                case 'r':
+                        flags |= ESCROW_REAP;
+                        break;
+                case 'm':
+                        flags |= ESCROW_MARK;
+                        break;
                 case 't':
                         nr_tags = atoi(optarg);
                         break;
+                case 's':
+                        quota.slots = atoi(optarg);
+                        break;
+                case 'n':
+                        quota.fds = atoi(optarg);
+                        break;
+                case 'b':
+                        quota.nob = atoll(optarg);
+                        break;
                 case 'h':
                 default:
                         usage();
@@ -58,7 +84,7 @@ int main(int argc, char **argv) {
         if (daemonise && daemon(true, true) != 0) {
                 err(EXIT_FAILURE, "daemon");
         }
-        return escrowd(argv[optind], flags, nr_tags);
+        return escrowd(argv[optind], flags, nr_tags, &quota);
 }
 
 /*